@@ -87,6 +87,16 @@ namespace indoor_context {
 		return linearized_intrinsics_;
 	}
 
+	//virtual
+	vector<double> ATANCamera::GetParameterVector() const {
+		Vec5 params = impl_->GetParams();
+		vector<double> v(1, 1.0);  // type tag
+		for (int i = 0; i < 5; i++) {
+			v.push_back(params[i]);
+		}
+		return v;
+	}
+
 	///////////////////////////////////////////////////////////////
 	// LinearCamera
 	LinearCamera::LinearCamera() {
@@ -125,6 +135,17 @@ namespace indoor_context {
 		return intrinsics();
 	}
 
+	// virtual
+	vector<double> LinearCamera::GetParameterVector() const {
+		vector<double> v(1, 0.0);  // type tag
+		for (int i = 0; i < 3; i++) {
+			for (int j = 0; j < 3; j++) {
+				v.push_back(m[i][j]);
+			}
+		}
+		return v;
+	}
+
 	///////////////////////////////////////////////////////////////
 	// PosedCamera
 	PosedCamera::PosedCamera(const toon::SE3<>& pose,
@@ -54,6 +54,12 @@ public:
 	// linear camera then this simply returns the intrinsics matrix.
 	virtual const Mat3& Linearize() const = 0;
 
+	// Get a vector that identifies the intrinsic parameters of this
+	// camera, excluding the image size. Two cameras with equal
+	// parameter vectors produce identical results from ImToRet and
+	// RetToIm for equal image sizes.
+	virtual vector<double> GetParameterVector() const = 0;
+
 	// Project each pixel through two different cameras and return the
 	// maximum deviation (euclidean distance). Can be used to compare
 	// an ATANCamera to its LinearCamera approximation.
@@ -85,6 +91,9 @@ public:
 	// Approximate this camera by a linear transform.
 	virtual const Mat3& Linearize() const;
 
+	// Get the type followed by the ATAN parameters
+	virtual vector<double> GetParameterVector() const;
+
 	// Get the underlying PTAM camera
 	inline PTAMM::ATANCamera& impl_camera() const { return *impl_; }
 private:
@@ -114,6 +123,9 @@ public:
 	// Same as intrinsics()
 	virtual const Mat3& Linearize() const;
 
+	// Get the type followed by the elements of the intrinsics matrix
+	virtual vector<double> GetParameterVector() const;
+
 	// Transform retina -> image
 	Vec2 RetToIm(const Vec2& v) const;
 	// Transform retina -> image in homogeneous coordinates
@@ -2,23 +2,29 @@
 #include <iomanip>
 #include <queue>
 
+#include <boost/bind.hpp>
 #include <boost/foreach.hpp>
 
 #include "common_types.h"
 #include "fast_sobel.h"
 #include "canny.h"
 #include "filters.h"
+#include "worker.h"
 
 #include "numeric_utils.tpp"
 #include "image_utils.tpp"
 #include "vw_image.tpp"
 
 namespace indoor_context {
+using boost::bind;
+using boost::ref;
+
 const lazyvar<float> gvSmoothingSigma("Gradients.SmoothingSigma");
 const lazyvar<float> gvThreshLow("Canny.ThreshLow");
 const lazyvar<float> gvThreshHigh("Canny.ThreshHigh");
 const lazyvar<int> gvNumOrientBins("Canny.NumOrientBins");
 const lazyvar<int> gvNumThreads("Canny.NumThreads");
+const lazyvar<int> gvParallelizeGradients("Sobel.Parallelize");
 
 // Clamp the position (r,c) to the matrix bounds and return the value
 // at that point.
@@ -39,26 +45,92 @@ void Gradients::ComputeMagSqrRow(int r) {
 	}
 }
 
+// Compute the boundaries between n orientation bins, where bin k
+// covers the angles within pi/2n of k*pi/n, modulo pi.
+void ComputeBoundaries(int n, vector<float>& cosines, vector<float>& sines) {
+	cosines.resize(n);
+	sines.resize(n);
+	for (int k = 0; k < n; k++) {
+		const double b = (k+0.5) * M_PI / n;
+		cosines[k] = cos(b);
+		sines[k] = sin(b);
+	}
+}
+
+// Get the orientation bin for a gradient with (dx,dy) already folded
+// into the upper half-plane. This is equivalent to binning the angle
+// from atan2 except for gradients lying within float rounding of a bin
+// boundary.
+inline int GetOrientBin(const float dx, const float dy,
+                        const vector<float>& cosines,
+                        const vector<float>& sines) {
+	// Count the boundaries that lie at or below the gradient angle. The
+	// boundaries are sorted so this is a binary search.
+	const int n = cosines.size();
+	int lo = 0, hi = n;
+	while (lo < hi) {
+		const int mid = (lo+hi) / 2;
+		if (cosines[mid]*dy - sines[mid]*dx >= 0) {
+			lo = mid+1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo == n ? 0 : lo;
+}
+
+void Gradients::ComputeBinBoundaries() {
+	if (dir4_cos.size() != 4) {
+		ComputeBoundaries(4, dir4_cos, dir4_sin);
+	}
+	if (dir16_cos.size() != *gvNumOrientBins) {
+		ComputeBoundaries(*gvNumOrientBins, dir16_cos, dir16_sin);
+	}
+}
+
 void Gradients::ComputeOrientRow(int r) {
-	const float kNbinsOverPi = *gvNumOrientBins / M_PI;
-	const float kFourOverPi = 4.0 / M_PI;
+	CHECK_EQ(dir4_cos.size(), 4) << "ComputeBinBoundaries() was not called";
 	const int& w = diffx.GetWidth();
 	const float thresh = atan_thresh * atan_thresh;
 	const PixelMono<float>* dxrow = diffx[r];
 	const PixelMono<float>* dyrow = diffy[r];
 	const float* magsqr = magnitude_sqr[r];
-	float* out_orient = orient[r];
+	float* out_orient = compute_orient ? orient[r] : NULL;
 	int* out_dir4 = dir4[r];
 	int* out_dir16 = dir16[r];
 	for (int c = 0; c < w; c++) {
-		const float& dx = dxrow[c].y;
-		const float& dy = dyrow[c].y;
 		if (magsqr[c] >= thresh) {
+			float dx = dxrow[c].y;
+			float dy = dyrow[c].y;
 			// atan2f is costly so only evaluate it if we really have to...
-			out_orient[c] = atan2f(dy, dx);
-			const float theta = out_orient[c] + M_PI;
-			out_dir16[c] = static_cast<int>(roundf(theta*kNbinsOverPi)) % 16;
-			out_dir4[c] = static_cast<int>(roundf(theta*kFourOverPi)) % 4;
+			if (out_orient) {
+				out_orient[c] = atan2f(dy, dx);
+			}
+			// The bins are modulo pi, so fold into the upper half-plane
+			if (dy < 0 || (dy == 0 && dx < 0)) {
+				dx = -dx;
+				dy = -dy;
+			}
+			out_dir16[c] = GetOrientBin(dx, dy, dir16_cos, dir16_sin);
+			out_dir4[c] = GetOrientBin(dx, dy, dir4_cos, dir4_sin);
+		}
+	}
+}
+
+void Gradients::ComputeOrientAngles() {
+	const int& w = diffx.GetWidth();
+	const int& h = diffx.GetHeight();
+	const float thresh = atan_thresh * atan_thresh;
+	orient.Resize(h, w);
+	for (int r = 0; r < h; r++) {
+		const PixelMono<float>* dxrow = diffx[r];
+		const PixelMono<float>* dyrow = diffy[r];
+		const float* magsqr = magnitude_sqr[r];
+		float* out_orient = orient[r];
+		for (int c = 0; c < w; c++) {
+			if (magsqr[c] >= thresh) {
+				out_orient[c] = atan2f(dyrow[c].y, dxrow[c].y);
+			}
 		}
 	}
 }
@@ -88,15 +160,33 @@ void Gradients::ComputeOrients() {
 	const int& w = diffx.GetWidth();
 	const int& h = diffy.GetHeight();
 
-	orient.Resize(h, w);
+	if (compute_orient) {
+		orient.Resize(h, w);
+	}
 	dir4.Resize(h, w);
 	dir16.Resize(h, w);
 
+	ComputeBinBoundaries();
 	ComputeOrientRows(0, h-1);
 	// TODO: go back to the parallel version
 	//ParallelPartition(h, *gvNumThreads, &mag_orient::ComputeMagSqrRows)
 }
 
+void Gradients::ComputeEdgeList(float mag_sqr_thresh,
+                                vector<ImageRef>& out) const {
+	const int& w = magnitude_sqr.Cols();
+	const int& h = magnitude_sqr.Rows();
+	out.clear();
+	for (int r = 0; r < h; r++) {
+		const float* magrow = magnitude_sqr[r];
+		for (int c = 0; c < w; c++) {
+			if (magrow[c] > mag_sqr_thresh) {
+				out.push_back(ImageRef(c, r));
+			}
+		}
+	}
+}
+
 
 void Gradients::ComputeSobel(const ImageF& input) {
 	// Smooth the image
@@ -116,11 +206,59 @@ void Gradients::ComputeSobel(const ImageF& input) {
 	FastSobel::ConvolveY(input, diffy);
 }
 
+void Gradients::ComputeFusedRows(const ImageF& input,
+                                 bool orients,
+                                 const int r0,
+                                 const int r1) {
+	const int& w = input.GetWidth();
+	const int& h = input.GetHeight();
+	for (int r = r0; r <= r1; r++) {
+		// Each row is consumed by the later stages while it is still in
+		// cache rather than after a full pass over the image.
+		const PixelF* rprev = input[r == 0 ? r : r-1];
+		const PixelF* rnext = input[r == h-1 ? r : r+1];
+		FastSobel::ConvolveRowX(w, rprev, input[r], rnext, diffx[r]);
+		FastSobel::ConvolveRowY(w, rprev, input[r], rnext, diffy[r]);
+		ComputeMagSqrRow(r);
+		if (orients) {
+			ComputeOrientRow(r);
+		}
+	}
+}
+
+void Gradients::ComputeFused(const ImageF& input, bool orients) {
+	const int& w = input.GetWidth();
+	const int& h = input.GetHeight();
+	if (*gvSmoothingSigma > 0.0) {
+		DLOG << "Warning, SmoothUniform not implemented but Gradients.SmoothingSigma was greater than 0";
+	}
+
+	ResizeImage(diffx, input.GetSize());
+	ResizeImage(diffy, input.GetSize());
+	magnitude_sqr.Resize(h, w);
+	if (orients) {
+		if (compute_orient) {
+			orient.Resize(h, w);
+		}
+		dir4.Resize(h, w);
+		dir16.Resize(h, w);
+		ComputeBinBoundaries();
+	}
+
+	if (*gvParallelizeGradients) {
+		const int nt = num_threads > 0 ? num_threads : *gvNumThreads;
+		ParallelPartition(h,
+		                  Clamp(nt, 1, max(h, 1)),
+		                  bind(&Gradients::ComputeFusedRows,
+		                       this, ref(input), orients, _1, _2));
+	} else {
+		ComputeFusedRows(input, orients, 0, h-1);
+	}
+}
+
 void Gradients::Compute(const ImageF& rawinput) {
 	prev_input = &rawinput;
-	ComputeSobel(rawinput);
-	ComputeMagSqr();
-	ComputeOrients();
+	ComputeFused(rawinput);
 }
 
 void Gradients::Compute(const ImageBundle& input) {
@@ -128,105 +266,223 @@ void Gradients::Compute(const ImageBundle& input) {
 	Compute(input.mono);
 }
 
-void CannyBase::NonMaxSuppression(MatF& gradient_mag_sqr,
-                                  const MatI& gradient_dir4,
-                                  vector<ImageRef>& high_list) {
+void CannyBase::NonMaxSuppressionBands(const MatF& gradient_mag_sqr,
+                                       const MatI& gradient_dir4,
+                                       int b0, int b1) {
 	const int& w = gradient_mag_sqr.Cols();
 	const int& h = gradient_mag_sqr.Rows();
 	const float kThreshHighSqr = *gvThreshHigh * *gvThreshHigh;
 	const float kThreshLowSqr = *gvThreshLow * *gvThreshLow;
 
-	high_list.reserve(5000);
-	for (int r = 0; r < h; r++) {
-		float* magrow = gradient_mag_sqr[r];
-		float* prevmagrow = gradient_mag_sqr[ (r==0 ? r : r-1) ];
-		float* nextmagrow = gradient_mag_sqr[ (r==h-1 ? r : r+1) ];
-		float* localrows[3] = {prevmagrow, magrow, nextmagrow};
-		const int* dirrow = gradient_dir4[r];
-		for (int c = 0; c < w; c++) {
-			float& v = magrow[c];
-			if (v >= kThreshLowSqr) {
-
-				int dr, dc;
-				switch (dirrow[c]) {
-				case 0: dr = 0; dc = 1; break;  // north-south edge
-				case 1: dr = 1; dc = 1; break; // southwest-northeast edge
-				case 2: dr = 1; dc = 0; break;  // east-west edge
-				case 3: dr = 1; dc = -1; break;  // southeast-northwest edge
-				default:
-					DLOG << "Error: dir=" << dirrow[c] << endl;
-					exit(-1);
-					break;
-				}
+	for (int b = b0; b <= b1; b++) {
+		vector<ImageRef>& high_list = band_lists[b];
+		high_list.clear();
+		for (int r = BandStart(b, h); r < BandStart(b+1, h); r++) {
+			const float* magrow = gradient_mag_sqr[r];
+			const float* prevmagrow = gradient_mag_sqr[ (r==0 ? r : r-1) ];
+			const float* nextmagrow = gradient_mag_sqr[ (r==h-1 ? r : r+1) ];
+			const float* localrows[3] = {prevmagrow, magrow, nextmagrow};
+			const int* dirrow = gradient_dir4[r];
+			int* suprow = suppressed[r];
+			for (int c = 0; c < w; c++) {
+				const float& v = magrow[c];
+				suprow[c] = 0;
+				if (v >= kThreshLowSqr) {
+
+					int dr, dc;
+					switch (dirrow[c]) {
+					case 0: dr = 0; dc = 1; break;  // north-south edge
+					case 1: dr = 1; dc = 1; break; // southwest-northeast edge
+					case 2: dr = 1; dc = 0; break;  // east-west edge
+					case 3: dr = 1; dc = -1; break;  // southeast-northwest edge
+					default:
+						DLOG << "Error: dir=" << dirrow[c] << endl;
+						exit(-1);
+						break;
+					}
 
-				const int nextc = Clamp(c+dc, 0, w-1);
-				const int prevc = Clamp(c-dc, 0, w-1);
-				// Must use abs() here because we do v=-v below
-				if (v < abs(localrows[dr+1][nextc]) ||
-						v < abs(localrows[-dr+1][prevc])) {
-					// We must not set v=0 because other pixels might be
-					// affected by this pixel. Instead set v=-v and use abs()
-					// above, then do another pass over the image below
-					v = -v;
-				} else if (v >= kThreshHighSqr) {
-					high_list.push_back(ImageRef(c, r));
+					const int nextc = Clamp(c+dc, 0, w-1);
+					const int prevc = Clamp(c-dc, 0, w-1);
+					// Neighbouring bands read these rows concurrently, so
+					// record suppressed pixels separately and only zero
+					// them once all bands have finished.
+					if (v < localrows[dr+1][nextc] ||
+							v < localrows[-dr+1][prevc]) {
+						suprow[c] = 1;
+					} else if (v >= kThreshHighSqr) {
+						high_list.push_back(ImageRef(c, r));
+					}
 				}
 			}
 		}
 	}
+}
 
-	// Set the negative values to zero
-	for (int r = 0; r < h; r++) {
+void CannyBase::SuppressBands(MatF& gradient_mag_sqr, int b0, int b1) {
+	const int& w = gradient_mag_sqr.Cols();
+	const int& h = gradient_mag_sqr.Rows();
+	for (int r = BandStart(b0, h); r < BandStart(b1+1, h); r++) {
 		float* row = gradient_mag_sqr[r];
+		const int* suprow = suppressed[r];
 		for (int c = 0; c < w; c++) {
-			if (row[c] < 0) {
+			if (suprow[c]) {
 				row[c] = 0;
 			}
 		}
 	}
 }
 
-void CannyBase::Hysterisis(const MatF& gradient_mag_sqr,
-                           const vector<ImageRef>& high_list) {
+int CannyBase::NumBandsFor(int h) const {
+	return Clamp(num_threads > 0 ? num_threads : *gvNumThreads, 1, max(h, 1));
+}
+
+void CannyBase::NonMaxSuppression(MatF& gradient_mag_sqr,
+                                  const MatI& gradient_dir4,
+                                  vector<ImageRef>& high_list) {
+	const int& w = gradient_mag_sqr.Cols();
+	const int& h = gradient_mag_sqr.Rows();
+	num_bands = NumBandsFor(h);
+	suppressed.Resize(h, w);
+	band_lists.resize(num_bands);
+
+	ParallelPartition(num_bands, num_bands,
+	                  bind(&CannyBase::NonMaxSuppressionBands, this,
+	                       ref(gradient_mag_sqr), ref(gradient_dir4), _1, _2));
+	ParallelPartition(num_bands, num_bands,
+	                  bind(&CannyBase::SuppressBands, this,
+	                       ref(gradient_mag_sqr), _1, _2));
+
+	// Concatenating the bands gives the pixels in row-major order
+	high_list.reserve(5000);
+	for (int b = 0; b < num_bands; b++) {
+		high_list.insert(high_list.end(), band_lists[b].begin(), band_lists[b].end());
+	}
+}
+
+void CannyBase::InitComponentBands(const MatF& gradient_mag_sqr, int b0, int b1) {
 	const int& w = gradient_mag_sqr.Cols();
 	const int& h = gradient_mag_sqr.Rows();
 	const float kThreshLowSqr = *gvThreshLow * *gvThreshLow;
+	for (int r = BandStart(b0, h); r < BandStart(b1+1, h); r++) {
+		const float* magrow = gradient_mag_sqr[r];
+		int* prow = &components.parents[r*w];
+		for (int c = 0; c < w; c++) {
+			prow[c] = magrow[c] > kThreshLowSqr ? r*w+c : -1;
+		}
+	}
+}
 
-	// Initialize the output containers
-	edge_list.clear();
-	edge_list.reserve(high_list.size() / 4);
+void CannyBase::LabelComponentBands(int b0, int b1) {
+	// Only merge with neighbours inside the band so that each thread
+	// touches a disjoint part of the forest. Band borders are merged
+	// afterwards by the caller.
+	const int& w = edge_map.Cols();
+	const int& h = edge_map.Rows();
+	const VecI& parent = components.parents;
+	for (int b = b0; b <= b1; b++) {
+		const int r0 = BandStart(b, h);
+		for (int r = r0; r < BandStart(b+1, h); r++) {
+			for (int c = 0; c < w; c++) {
+				const int i = r*w+c;
+				if (parent[i] == -1) continue;
+				if (c > 0 && parent[i-1] != -1) {
+					components.MergeMin(i, i-1);
+				}
+				if (r > r0) {
+					for (int nc = max(c-1, 0); nc <= min(c+1, w-1); nc++) {
+						if (parent[i-w-c+nc] != -1) {
+							components.MergeMin(i, i-w-c+nc);
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
+void CannyBase::CollectEdgeBands(int b0, int b1) {
+	const int& w = edge_map.Cols();
+	const int& h = edge_map.Rows();
+	const VecI& parent = components.parents;
+	for (int b = b0; b <= b1; b++) {
+		vector<ImageRef>& list = band_lists[b];
+		list.clear();
+		for (int r = BandStart(b, h); r < BandStart(b+1, h); r++) {
+			int* edgerow = edge_map[r];
+			for (int c = 0; c < w; c++) {
+				const int i = r*w+c;
+				if (parent[i] != -1 && root_has_seed[components.GetGroupConst(i)]) {
+					edgerow[c] = 1;
+					list.push_back(ImageRef(c, r));
+				} else {
+					edgerow[c] = 0;
+				}
+			}
+		}
+	}
+}
+
+void CannyBase::Hysterisis(const MatF& gradient_mag_sqr,
+                           const vector<ImageRef>& high_list) {
+	// An edge pixel is any pixel above the low threshold that is
+	// connected to a pixel above the high threshold. We label the
+	// connected components of the above-threshold pixels using
+	// union-find, and keep those components that contain a high pixel.
+	const int& w = gradient_mag_sqr.Cols();
+	const int& h = gradient_mag_sqr.Rows();
+	num_bands = NumBandsFor(h);
 	edge_map.Resize(h, w);
-	edge_map.Fill(0);
-	queue<ImageRef> queue;  // re-use for efficiency
+	VecI& parent = components.parents;
+	if (parent.size() < w*h) {
+		parent.Resize(w*h);
+	}
+	band_lists.resize(num_bands);
 
-	// Iterate over the pixels that are above the high threshold
+	ParallelPartition(num_bands, num_bands,
+	                  bind(&CannyBase::InitComponentBands, this,
+	                       ref(gradient_mag_sqr), _1, _2));
+	// High pixels are always edges, even if they are not above the low
+	// threshold
 	BOOST_FOREACH(const ImageRef& p, high_list) {
-		// Check that we haven't already visited here
-		if (!edge_map[p.y][p.x]) {
-			queue.push(p);
-			edge_map[p.y][p.x] = 1;
-
-			// BFS from here
-			while (!queue.empty()) {
-				const int r = queue.front().y;
-				const int c = queue.front().x;
-				edge_list.push_back(queue.front());
-				queue.pop();
-
-				for (int nr = r-1; nr <= r+1; nr++) {
-					for (int nc = c-1; nc <= c+1; nc++) {
-						if (nr == r && nc == c) continue;
-						if (nr<0 || nr>=h || nc<0 || nc>=w) continue;
-						if (!edge_map[nr][nc] &&
-								gradient_mag_sqr[nr][nc] > kThreshLowSqr) {
-							queue.push(ImageRef(nc, nr));
-							edge_map[nr][nc] = 1;
-						}
-					}
+		const int i = p.y*w+p.x;
+		if (parent[i] == -1) {
+			parent[i] = i;
+		}
+	}
+
+	ParallelPartition(num_bands, num_bands,
+	                  bind(&CannyBase::LabelComponentBands, this, _1, _2));
+
+	// Merge components across band borders
+	for (int b = 1; b < num_bands; b++) {
+		const int r = BandStart(b, h);
+		if (r == 0 || r >= h) continue;
+		for (int c = 0; c < w; c++) {
+			const int i = r*w+c;
+			if (parent[i] == -1) continue;
+			for (int nc = max(c-1, 0); nc <= min(c+1, w-1); nc++) {
+				if (parent[i-w-c+nc] != -1) {
+					components.MergeMin(i, i-w-c+nc);
 				}
 			}
 		}
 	}
+
+	// Mark the components that contain a high pixel
+	root_has_seed.resize(w*h);
+	fill(root_has_seed.begin(), root_has_seed.end(), 0);
+	BOOST_FOREACH(const ImageRef& p, high_list) {
+		root_has_seed[components.GetGroup(p.y*w+p.x)] = 1;
+	}
+
+	// Fill the outputs. Concatenating the bands gives the edge list in
+	// row-major order.
+	ParallelPartition(num_bands, num_bands,
+	                  bind(&CannyBase::CollectEdgeBands, this, _1, _2));
+	edge_list.clear();
+	for (int b = 0; b < num_bands; b++) {
+		edge_list.insert(edge_list.end(), band_lists[b].begin(), band_lists[b].end());
+	}
 }
 
 void CannyBase::DetectEdges(MatF& gradient_mag_sqr,
@@ -244,6 +500,8 @@ void Canny::Compute(const ImageBundle& input) {
 void Canny::Compute(const ImageF& input) {
 	// Compute gradient magnitude and orientation
 	gradients.atan_thresh = *gvThreshLow;
+	gradients.compute_orient = false;  // only dir4 is needed below
+	gradients.num_threads = num_threads;
 	gradients.Compute(input);
 	// Evaluate the detector
 	DetectEdges(gradients.magnitude_sqr, gradients.dir4);
@@ -265,52 +523,84 @@ void Canny::OutputYSobelViz(const string& path) {
 	WriteImage(path, gradients.diffy);
 }
 
-void MultiScaleCanny::Compute(const ImageF& input) {
-	const int& w = input.GetWidth();
-	const int& h = input.GetHeight();
+void MultiScaleCanny::ComputeScales(const ImageF& input, int s0, int s1) {
 	const float kThreshLowSqr = *gvThreshLow * *gvThreshLow;
-	dir4.Resize(h, w);
-	dir16.Resize(h, w);
-	magnitude_sqr.Resize(h, w);
-	magnitude_sqr.Fill(0);
-
-	// Compute gradients at multiple scales
-	MatF mag_sqr_upsampled;
-	const ImageF* cur_level = &input;
-	const MatF* cur_mag_sqr;
-	scoped_ptr<ImageF> storage;
-	for (int i = 0; i < gradients.size(); i++) {
-		// Compute gradients
+	for (int i = s0; i <= s1; i++) {
 		gradients[i]->atan_thresh = kThreshLowSqr;
-		gradients[i]->Compute(*cur_level);
-
-		// Upsample
+		gradients[i]->compute_orient = false;
 		if (i == 0) {
-			cur_mag_sqr = &gradients[i]->magnitude_sqr;
+			gradients[i]->Compute(input);
 		} else {
-			mag_sqr_upsampled.Resize(h, w);
-			Upsample(gradients[i]->magnitude_sqr, 1<<i, mag_sqr_upsampled);
-			cur_mag_sqr = &mag_sqr_upsampled;
+			gradients[i]->Compute(level_images[i-1]);
+			Upsample(gradients[i]->magnitude_sqr, 1<<i, upsampled[i-1]);
 		}
+	}
+}
 
-		// Take maximum
-		for (int r = 0; r < h; r++) {
-			const float* in_mag = (*cur_mag_sqr)[r];
-			float* out_mag = magnitude_sqr[r];
+void MultiScaleCanny::ComputeMaxRows(int r0, int r1) {
+	const int& w = magnitude_sqr.Cols();
+	for (int r = r0; r <= r1; r++) {
+		float* out_mag = magnitude_sqr[r];
+		const float* in_mag = gradients[0]->magnitude_sqr[r];
+		for (int c = 0; c < w; c++) {
+			out_mag[c] = in_mag[c];
+		}
+		for (int i = 0; i < upsampled.size(); i++) {
+			in_mag = upsampled[i][r];
 			for (int c = 0; c < w; c++) {
 				out_mag[c] = max(in_mag[c], out_mag[c]);
 			}
 		}
+	}
+}
 
-		// Downsample
-		if (i < gradients.size()-1) {
-			CHECK(false)
-				<< "This part needs to be fixed: gradients.smoothed no longer exists";
-		//storage.reset(Downsample(gradients[i]->smoothed, 2));
-			cur_level = storage.get();
+void MultiScaleCanny::Compute(const ImageF& input) {
+	const int& w = input.GetWidth();
+	const int& h = input.GetHeight();
+	const int n = gradients.size();
+	CHECK_GT(n, 0);
+	const int maxs = 1<<(n-1);
+	CHECK(h%maxs == 0 && w%maxs == 0)
+		<< "Input size must be divisible by 2^(NumScales-1), size was: "
+		<< w << "x" << h;
+
+	// Build the pyramid. Level 0 is the input itself so only the
+	// coarser levels need to be copied into images.
+	level_images.resize(n-1);
+	upsampled.resize(n-1);
+	if (n > 1) {
+		input_mat.Resize(h, w);
+		for (int r = 0; r < h; r++) {
+			const PixelF* inrow = input[r];
+			float* outrow = input_mat[r];
+			for (int c = 0; c < w; c++) {
+				outrow[c] = inrow[c].y;
+			}
+		}
+		pyramid.ComputeLevels(input_mat, n);
+		for (int i = 1; i < n; i++) {
+			const MatF& level = *pyramid.levels[i];
+			ResizeImage(level_images[i-1], ImageRef(level.Cols(), level.Rows()));
+			for (int r = 0; r < level.Rows(); r++) {
+				const float* inrow = level[r];
+				PixelF* outrow = level_images[i-1][r];
+				for (int c = 0; c < level.Cols(); c++) {
+					outrow[c].y = inrow[c];
+				}
+			}
+			upsampled[i-1].Resize(h, w);
 		}
 	}
 
+	// Compute gradients at all scales concurrently
+	ParallelPartition(n, n, bind(&MultiScaleCanny::ComputeScales,
+	                             this, ref(input), _1, _2));
+
+	// Take the maximum over scales
+	magnitude_sqr.Resize(h, w);
+	ParallelPartition(h, min(h, *gvNumThreads),
+	                  bind(&MultiScaleCanny::ComputeMaxRows, this, _1, _2));
+
 	// Apply non-maximal suppression and hysterisis
 	dir4 = gradients[0]->dir4;
 	dir16 = gradients[0]->dir16;
@@ -1,9 +1,12 @@
 #pragma once
 
 #include <boost/shared_ptr.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
 
 #include "common_types.h"
 #include "image_bundle.h"
+#include "gaussian_pyramid.h"
+#include "union_find.h"
 
 namespace indoor_context {
 using boost::shared_ptr;
@@ -15,6 +18,11 @@ public:
 	float atan_thresh;  // if the squared magnitude is below this
 										  // threshold then the gradient orientation will
 										  // not be computed
+	bool compute_orient;  // if false then only dir4 and dir16 are filled
+	                      // and orient is left empty until
+	                      // ComputeOrientAngles is called (default true)
+	int num_threads;  // threads to use if Sobel.Parallelize is set, or 0
+	                  // to use Canny.NumThreads (default 0)
 
 	// Last input image passed to Compute
 	const ImageF* prev_input;
@@ -28,12 +36,14 @@ public:
 	MatI dir16;  // Gradient orientation binned 16 ways
 
 	// Initialize an empty gradient filter
-	Gradients() : atan_thresh(0) { }
+	Gradients() : atan_thresh(0), compute_orient(true), num_threads(0) { }
 	// Initialize a gradient filter and run it for the specified image
-	Gradients(const ImageF& input) : atan_thresh(0) {
+	Gradients(const ImageF& input)
+		: atan_thresh(0), compute_orient(true), num_threads(0) {
 		Compute(input);
 	}
-	Gradients(const ImageBundle& input) : atan_thresh(0) {
+	Gradients(const ImageBundle& input)
+		: atan_thresh(0), compute_orient(true), num_threads(0) {
 		Compute(input);
 	}
 
@@ -42,6 +52,13 @@ public:
 	void Compute(const ImageBundle& input);
 	void Compute(const ImageF& input);
 
+	// Fill diffx, diffy, magnitude_sqr, and optionally orient, dir4,
+	// and dir16 in a single pass over the image. Output is identical to
+	// calling ComputeSobel, ComputeMagSqr, and ComputeOrients in turn.
+	void ComputeFused(const ImageF& input, bool orients=true);
+	// Fill an interval of rows of all outputs from ComputeFused
+	void ComputeFusedRows(const ImageF& input, bool orients, int r0, int r1);
+
 	// Fill diffx and diffy
 	void ComputeSobel(const ImageF& input);
 
@@ -54,11 +71,28 @@ public:
 
 	// Fill orient, dir4, and dir16
 	void ComputeOrients();
+	// Compute the orientation bin boundaries. Must be called before
+	// ComputeOrientRows or ComputeOrientRow.
+	void ComputeBinBoundaries();
 	// Fill an interval of rows in orient, dir4, and dir16
 	void ComputeOrientRows(int r0, int r1);
-	// Fill one row of orient, dir4, and dir16 from magnitude_sqr
+	// Fill one row of orient, dir4, and dir16 from magnitude_sqr. The
+	// bins are computed by comparing (dx,dy) against the bin boundaries
+	// so atan2 is only evaluated if compute_orient is true.
 	void ComputeOrientRow(int r);
+
+	// Fill orient from diffx and diffy. Only needed if compute_orient
+	// was false when the gradients were computed.
+	void ComputeOrientAngles();
+
+	// List the pixels with magnitude_sqr strictly greater than the
+	// threshold, in row-major order
+	void ComputeEdgeList(float mag_sqr_thresh, vector<ImageRef>& out) const;
 private:
+	// Cosines and sines of the boundaries between orientation bins
+	vector<float> dir4_cos, dir4_sin;
+	vector<float> dir16_cos, dir16_sin;
+
 	void ProcessRow(int r);
 	void ProcessRows(int r0, int r1);
 };
@@ -67,7 +101,13 @@ private:
 class CannyBase {
 public:
 	MatI edge_map;  // Binary edge map
-	vector<ImageRef> edge_list;  // List of edge pixels
+	vector<ImageRef> edge_list;  // List of edge pixels in row-major order
+	// Number of threads for each stage, or 0 to use Canny.NumThreads.
+	// The output does not depend on this.
+	int num_threads;
+
+	// Constructor
+	CannyBase() : num_threads(0), num_bands(1) { }
 
 	// Suppress non-maximal edge responses
 	void NonMaxSuppression(MatF& gradient_mag_sqr,
@@ -80,6 +120,29 @@ public:
 	// Run non-maximal suppression and hysterisis
 	void DetectEdges(MatF& gradient_mag_sqr,
 									 const MatI& gradient_dir4);
+private:
+	// Both stages above are partitioned into horizontal bands that are
+	// processed in parallel. The following process the bands in the
+	// interval [b0,b1].
+	void NonMaxSuppressionBands(const MatF& gradient_mag_sqr,
+	                            const MatI& gradient_dir4,
+	                            int b0, int b1);
+	void SuppressBands(MatF& gradient_mag_sqr, int b0, int b1);
+	void InitComponentBands(const MatF& gradient_mag_sqr, int b0, int b1);
+	void LabelComponentBands(int b0, int b1);
+	void CollectEdgeBands(int b0, int b1);
+
+	// Scratch space re-used between frames
+	int num_bands;
+	MatI suppressed;  // pixels removed by non-maximal suppression
+	UnionFind components;  // forest over pixels, with parent -1 for non-candidates
+	vector<char> root_has_seed;  // components containing a high pixel
+	vector<vector<ImageRef> > band_lists;  // output from each band
+
+	// Get the first row in band b
+	inline int BandStart(int b, int h) const { return b*h/num_bands; }
+	// Get the number of bands for an image with h rows
+	int NumBandsFor(int h) const;
 };
 
 
@@ -124,6 +187,8 @@ class MultiScaleCanny : public CannyBase {
 public:
 	// Gradient magnitude and orientation at each scale
 	vector<shared_ptr<Gradients> > gradients;
+	// Gaussian pyramid from which each scale is computed
+	GaussianPyramid pyramid;
 
 	MatF magnitude_sqr;  // max magnitude over scales
 	MatI dir4;  // ref to gradients[0]->dir4
@@ -138,6 +203,15 @@ public:
 
 	// Run the multi-scale detector for this image
 	void Compute(const ImageF& input);
+private:
+	// Buffers re-used between frames
+	MatF input_mat;  // copy of the input for the pyramid
+	boost::ptr_vector<ImageF> level_images;  // pyramid levels 1..n-1
+	boost::ptr_vector<MatF> upsampled;  // magnitudes upsampled to full size
+
+	// Compute gradients for scales in the interval [s0,s1]
+	void ComputeScales(const ImageF& input, int s0, int s1);
+	// Fill rows in [r0,r1] of magnitude_sqr from the upsampled magnitudes
+	void ComputeMaxRows(int r0, int r1);
 };
-
 }
@@ -74,6 +74,43 @@ namespace indoor_context {
 		}
 	}
 
+	void DPPayoffs::AddWeighted(const vector<const DPPayoffs*>& features,
+															const vector<double>& weights,
+															const MatF* delta) {
+		CHECK_EQ(features.size(), weights.size());
+		for (int k = 0; k < features.size(); k++) {
+			CHECK_SAME_SIZE(features[k]->wall_scores[0], wall_scores[0]);
+			CHECK_SAME_SIZE(features[k]->wall_scores[1], wall_scores[1]);
+		}
+		if (delta != NULL) {
+			CHECK_SAME_SIZE(*delta, wall_scores[0]);
+		}
+
+		// Each output row stays in cache while all features are added to
+		// it. The order of operations per element is the same as for
+		// repeated calls to Add().
+		int nf = features.size();
+		int nx = wall_scores[0].Cols();
+		for (int i = 0; i < 2; i++) {
+			for (int y = 0; y < wall_scores[i].Rows(); y++) {
+				float* out = wall_scores[i][y];
+				for (int k = 0; k < nf; k++) {
+					const float* in = features[k]->wall_scores[i][y];
+					double weight = weights[k];
+					for (int x = 0; x < nx; x++) {
+						out[x] += weight*in[x];
+					}
+				}
+				if (delta != NULL) {
+					const float* in = (*delta)[y];
+					for (int x = 0; x < nx; x++) {
+						out[x] += static_cast<double>(in[x]);
+					}
+				}
+			}
+		}
+	}
+
 	void DPPayoffs::CopyTo(DPPayoffs& other) const {
 		other.wall_scores[0] = wall_scores[0];
 		other.wall_scores[1] = wall_scores[1];
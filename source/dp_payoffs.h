@@ -46,6 +46,14 @@ namespace indoor_context {
 		// Add a payoff matrix to both wall_scores[0] and wall_scores[1],
 		// multiplied by a constant.
 		void Add(const MatF& delta, double weight=1.0);
+		// Add a weighted sum of payoff matrices, and optionally a
+		// further matrix added to both wall_scores[0] and
+		// wall_scores[1]. The result is identical to calling Add() once
+		// per feature and then Add(*delta), but all inputs are
+		// accumulated row by row in a single pass over the output.
+		void AddWeighted(const vector<const DPPayoffs*>& features,
+										 const vector<double>& weights,
+										 const MatF* delta=NULL);
 	private:
 		// Disallow copy constructor (use CopyTo explicitly instead)
 		DPPayoffs(const DPPayoffs& rhs);
@@ -0,0 +1,188 @@
+#include "fft_convolver.h"
+
+#include <cmath>
+
+#include "common_types.h"
+
+#include "numeric_utils.tpp"
+
+namespace indoor_context {
+
+// Get the smallest power of two that is at least n
+static int NextPowerOfTwo(int n) {
+	int p = 1;
+	while (p < n) {
+		p *= 2;
+	}
+	return p;
+}
+
+// Precompute the tables for a radix-2 transform of length n
+static void PrepareTables(int n,
+                          vector<FFTConvolver::Complex>& twiddles,
+                          vector<int>& bitrev) {
+	twiddles.resize(n/2);
+	for (int i = 0; i < n/2; i++) {
+		twiddles[i] = std::polar(1.0, -2.0*M_PI*i/n);
+	}
+	int nbits = 0;
+	while ((1 << nbits) < n) {
+		nbits++;
+	}
+	bitrev.resize(n);
+	for (int i = 0; i < n; i++) {
+		int r = 0;
+		for (int b = 0; b < nbits; b++) {
+			r |= ((i >> b) & 1) << (nbits-1-b);
+		}
+		bitrev[i] = r;
+	}
+}
+
+// In-place iterative radix-2 transform of n values. The inverse is
+// unnormalized.
+static void Transform1D(FFTConvolver::Complex* data,
+                        int n,
+                        const vector<FFTConvolver::Complex>& twiddles,
+                        const vector<int>& bitrev,
+                        bool inverse) {
+	for (int i = 0; i < n; i++) {
+		if (i < bitrev[i]) {
+			swap(data[i], data[bitrev[i]]);
+		}
+	}
+	for (int len = 2; len <= n; len *= 2) {
+		const int half = len/2;
+		const int step = n/len;
+		for (int i = 0; i < n; i += len) {
+			for (int j = 0; j < half; j++) {
+				FFTConvolver::Complex w = inverse ? conj(twiddles[j*step]) : twiddles[j*step];
+				FFTConvolver::Complex u = data[i+j];
+				FFTConvolver::Complex v = data[i+j+half] * w;
+				data[i+j] = u + v;
+				data[i+j+half] = u - v;
+			}
+		}
+	}
+}
+
+FFTConvolver::FFTConvolver(int w, int h, int max_rad)
+	: width(w), height(h), pad(max_rad) {
+	CHECK_GT(w, 0);
+	CHECK_GT(h, 0);
+	CHECK_GE(max_rad, 0);
+	// Padding by the kernel radius on each side means that the circular
+	// convolution never wraps around into the image
+	nx = NextPowerOfTwo(w + 2*pad);
+	ny = NextPowerOfTwo(h + 2*pad);
+	PrepareTables(nx, twiddles_x, bitrev_x);
+	PrepareTables(ny, twiddles_y, bitrev_y);
+	image_spectrum.resize(nx*ny);
+	buffer.resize(max(nx*ny, ny));
+}
+
+void FFTConvolver::Transform(vector<Complex>& data, bool inverse) {
+	for (int r = 0; r < ny; r++) {
+		Transform1D(&data[r*nx], nx, twiddles_x, bitrev_x, inverse);
+	}
+	// Copy each column out so that the transform runs on contiguous memory
+	vector<Complex> column(ny);
+	for (int c = 0; c < nx; c++) {
+		for (int r = 0; r < ny; r++) {
+			column[r] = data[r*nx+c];
+		}
+		Transform1D(&column[0], ny, twiddles_y, bitrev_y, inverse);
+		for (int r = 0; r < ny; r++) {
+			data[r*nx+c] = column[r];
+		}
+	}
+}
+
+int FFTConvolver::AddDiffKernel(const VecD& kx1,
+                                const VecD& ky1,
+                                const VecD& kx2,
+                                const VecD& ky2) {
+	CHECK_EQ(kx1.Size(), kx2.Size());
+	CHECK_EQ(ky1.Size(), ky2.Size());
+	const int xrad = kx1.Size()/2;
+	const int yrad = ky1.Size()/2;
+	CHECK_LE(xrad, pad);
+	CHECK_LE(yrad, pad);
+
+	// SeperatedFilter computes a correlation, which is a convolution
+	// with the kernel reflected about the origin
+	kernels.push_back(vector<Complex>(nx*ny, 0.0));
+	vector<Complex>& k = kernels.back();
+	for (int dr = -yrad; dr <= yrad; dr++) {
+		int r = (ny - dr) % ny;
+		for (int dc = -xrad; dc <= xrad; dc++) {
+			int c = (nx - dc) % nx;
+			k[r*nx+c] = ky1[dr+yrad]*kx1[dc+xrad] - ky2[dr+yrad]*kx2[dc+xrad];
+		}
+	}
+	Transform(k, false);
+	return kernels.size()-1;
+}
+
+void FFTConvolver::LoadImage(const MatF& image) {
+	CHECK_EQ(image.Cols(), width);
+	CHECK_EQ(image.Rows(), height);
+	// Fill the whole buffer by clamping to the image, as SeperatedFilter
+	// does at the borders
+	for (int r = 0; r < ny; r++) {
+		const float* inrow = image[Clamp(r-pad, 0, height-1)];
+		Complex* outrow = &image_spectrum[r*nx];
+		for (int c = 0; c < nx; c++) {
+			outrow[c] = inrow[Clamp(c-pad, 0, width-1)];
+		}
+	}
+	Transform(image_spectrum, false);
+}
+
+void FFTConvolver::Convolve(int kernel, MatF& output) {
+	CHECK_INDEX(kernel, kernels);
+	const Complex* k = &kernels[kernel][0];
+	for (int i = 0; i < nx*ny; i++) {
+		buffer[i] = image_spectrum[i] * k[i];
+	}
+	Transform(buffer, true);
+	Extract(&output, NULL);
+}
+
+void FFTConvolver::ConvolvePair(int kernel1, int kernel2,
+                                MatF& output1, MatF& output2) {
+	CHECK_INDEX(kernel1, kernels);
+	CHECK_INDEX(kernel2, kernels);
+	// Both responses are real so put the second in the imaginary part
+	const Complex i_unit(0.0, 1.0);
+	const Complex* k1 = &kernels[kernel1][0];
+	const Complex* k2 = &kernels[kernel2][0];
+	for (int i = 0; i < nx*ny; i++) {
+		buffer[i] = image_spectrum[i] * (k1[i] + i_unit*k2[i]);
+	}
+	Transform(buffer, true);
+	Extract(&output1, &output2);
+}
+
+void FFTConvolver::Extract(MatF* real_output, MatF* imag_output) const {
+	const double scale = 1.0 / (nx*ny);
+	if (real_output) real_output->Resize(height, width);
+	if (imag_output) imag_output->Resize(height, width);
+	for (int r = 0; r < height; r++) {
+		const Complex* inrow = &buffer[(r+pad)*nx + pad];
+		if (real_output) {
+			float* outrow = (*real_output)[r];
+			for (int c = 0; c < width; c++) {
+				outrow[c] = inrow[c].real() * scale;
+			}
+		}
+		if (imag_output) {
+			float* outrow = (*imag_output)[r];
+			for (int c = 0; c < width; c++) {
+				outrow[c] = inrow[c].imag() * scale;
+			}
+		}
+	}
+}
+
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <complex>
+
+#include <boost/utility.hpp>
+#include "common_types.h"
+
+namespace indoor_context {
+
+// Runs convolutions in the frequency domain on the CPU. The input image
+// is transformed once, then each kernel is applied as a pointwise
+// product, so this pays off when many kernels are applied to the same
+// image. Results match SeperatedFilter::RunSequential, including the
+// clamping at the image borders, up to rounding error.
+class FFTConvolver : public boost::noncopyable {
+public:
+	typedef std::complex<double> Complex;
+
+	// Prepare for images of the given size and kernels with radius up
+	// to max_rad in each direction
+	FFTConvolver(int width, int height, int max_rad);
+
+	// Add the kernel for image*kernel1 - image*kernel2 (as computed by
+	// DiffFilter) and return its index. Kernels are transformed once
+	// and kept until this object is destroyed.
+	int AddDiffKernel(const VecD& kernelx1,
+	                  const VecD& kernely1,
+	                  const VecD& kernelx2,
+	                  const VecD& kernely2);
+	// Get the number of kernels
+	int num_kernels() const { return kernels.size(); }
+
+	// Load an image and transform it to the frequency domain
+	void LoadImage(const MatF& image);
+	// Apply a kernel to the current image
+	void Convolve(int kernel, MatF& output);
+	// Apply two kernels to the current image. This takes a single
+	// inverse transform since both outputs are real.
+	void ConvolvePair(int kernel1, int kernel2, MatF& output1, MatF& output2);
+
+private:
+	int width, height;  // image size
+	int pad;            // border added on each side of the image
+	int nx, ny;         // transform size (powers of two)
+	vector<Complex> twiddles_x, twiddles_y;
+	vector<int> bitrev_x, bitrev_y;
+	vector<Complex> image_spectrum;
+	vector<vector<Complex> > kernels;
+	vector<Complex> buffer;  // scratch for products and column transforms
+
+	// Transform a buffer of size nx*ny in place
+	void Transform(vector<Complex>& data, bool inverse);
+	// Write the real and imaginary parts of the inverse transform in
+	// buffer to the outputs (either may be NULL)
+	void Extract(MatF* real_output, MatF* imag_output) const;
+};
+
+}
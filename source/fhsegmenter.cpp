@@ -1,4 +1,5 @@
 #include <algorithm>
+#include <cstring>
 #include <numeric>
 #include <ext/numeric>
 #include <stack>
@@ -14,6 +15,7 @@
 #include "timer.h"
 #include "filters.h"
 #include "image_bundle.h"
+#include "worker.h"
 #include "image_utils.tpp"
 
 #include <boost/bind.hpp>
@@ -24,11 +26,206 @@ namespace indoor_context {
 	const lazyvar<float> gvMinSize("FHSegmenter.MinSize");
 	const lazyvar<float> gvMinDiff("FHSegmenter.MinDiff");
 	const lazyvar<float> gvSigma("FHSegmenter.SmoothingSigma");
+	const lazyvar<string> gvEdgeStrategy("FHSegmenter.EdgeStrategy");
 
-	FHSegmenter::FHSegmenter() {
+	using boost::bind;
+
+	// Edges are radix sorted on this many bits of their weight per pass
+	static const int kRadixBits = 8;
+	static const int kNumBuckets = 1 << kRadixBits;
+	static const int kNumPasses = 32 / kRadixBits;
+
+	int ExtractEdgeRows(const MatF& image,
+	                    const MatI& segmentation,
+	                    int r0,
+	                    int r1,
+	                    Edge* out) {
+		const int w = image.Cols();
+		Edge* e = out;
+		for (int r = r0; r <= r1; r++) {
+			const float* row = image[r];
+			const float* nextrow = image[r+1];
+			const int* segrow = segmentation[r];
+			const int* nextsegrow = segmentation[r+1];
+			for (int c = 0; c < w-1; c++) {
+				// Add horizontal edge
+				if (segrow[c] != segrow[c+1]) {
+					e->src = segrow[c];
+					e->dest = segrow[c+1];
+					e->weight = fabsf(row[c] - row[c+1]);
+					e++;
+				}
+				e->src = segrow[c];
+				e->dest = nextsegrow[c];
+				e->weight = fabsf(row[c] - nextrow[c]);
+				e++;
+			}
+		}
+		return e - out;
+	}
+
+	// Edge weights are non-negative, so their bit patterns sort in the
+	// same order as the weights themselves.
+	static inline unsigned int WeightKey(float weight) {
+		unsigned int key;
+		memcpy(&key, &weight, sizeof(key));
+		return key;
+	}
+
+	// Extracts edges in parallel row bands, then sorts them with a
+	// least-significant-digit radix sort. Each pass is stable, so
+	// equal weights keep the order of the sequential extraction loop.
+	// The result is identical to stable_sort() on that order, whatever
+	// the number of threads.
+	class ParallelEdgeSorter {
+	public:
+		ParallelEdgeSorter(const MatF& image,
+		                   const MatI& segmentation,
+		                   vector<Edge>& edges,
+		                   vector<Edge>& buffer,
+		                   int num_threads)
+			: image_(image), segmentation_(segmentation),
+			  edges_(edges), buffer_(buffer), num_threads_(num_threads) { }
+
+		// Extract and sort the edges, leaving them in the edge vector.
+		// Both vectors must have space for 2*(w-1)*(h-1) edges. Returns
+		// the number of edges.
+		int Run() {
+			const int w = image_.Cols();
+			const int h = image_.Rows();
+			if (w < 2 || h < 2) return 0;
+			num_chunks = max(1, min(h-1, num_threads_));
+			chunk_starts.resize(num_chunks);
+			chunk_sizes.resize(num_chunks);
+			counts.resize(num_chunks * kNumBuckets);
+			src = &edges_[0];
+			dst = &buffer_[0];
+
+			// Each band writes to its own region of the edge vector and
+			// counts the lowest digits as it goes
+			shift = 0;
+			ParallelPartition(num_chunks, num_chunks,
+			                  bind(&ParallelEdgeSorter::ExtractBands, this, _1, _2));
+			const int n = accumulate(chunk_sizes.begin(), chunk_sizes.end(), 0);
+			if (n == 0) return 0;
+
+			for (int pass = 0; pass < kNumPasses; pass++) {
+				shift = pass * kRadixBits;
+				// The first pass also packs the bands together, after that
+				// the edges are contiguous and are split evenly
+				if (pass > 0) {
+					for (int i = 0; i < num_chunks; i++) {
+						chunk_starts[i] = static_cast<long long>(n) * i / num_chunks;
+						chunk_sizes[i] = static_cast<long long>(n) * (i+1) / num_chunks - chunk_starts[i];
+					}
+					ParallelPartition(num_chunks, num_chunks,
+					                  bind(&ParallelEdgeSorter::CountChunks, this, _1, _2));
+					if (AllInOneBucket(n)) continue;
+				}
+
+				// Order the output by digit, then by chunk, to keep the sort stable
+				int offset = 0;
+				for (int d = 0; d < kNumBuckets; d++) {
+					for (int i = 0; i < num_chunks; i++) {
+						int& count = counts[i*kNumBuckets + d];
+						const int next = offset + count;
+						count = offset;
+						offset = next;
+					}
+				}
+				ParallelPartition(num_chunks, num_chunks,
+				                  bind(&ParallelEdgeSorter::ScatterChunks, this, _1, _2));
+				swap(src, dst);
+			}
+
+			if (src != &edges_[0]) {
+				edges_.swap(buffer_);
+			}
+			return n;
+		}
+
+	private:
+		const MatF& image_;
+		const MatI& segmentation_;
+		vector<Edge>& edges_;
+		vector<Edge>& buffer_;
+		const int num_threads_;
+
+		Edge* src;
+		Edge* dst;
+		int shift;  // of the digit for the current pass
+		int num_chunks;
+		vector<int> chunk_starts;  // offsets into src
+		vector<int> chunk_sizes;
+		vector<int> counts;  // digit counts, then output offsets, per chunk
+
+		inline int Digit(const Edge& e) const {
+			return (WeightKey(e.weight) >> shift) & (kNumBuckets-1);
+		}
+
+		void ExtractBands(int i0, int i1) {
+			const int num_rows = image_.Rows()-1;
+			const int row_capacity = 2*(image_.Cols()-1);
+			for (int i = i0; i <= i1; i++) {
+				const int r0 = num_rows * i / num_chunks;
+				const int r1 = num_rows * (i+1) / num_chunks - 1;
+				chunk_starts[i] = r0 * row_capacity;
+				chunk_sizes[i] = ExtractEdgeRows(image_, segmentation_, r0, r1,
+				                                 src + chunk_starts[i]);
+			}
+			CountChunks(i0, i1);
+		}
+
+		void CountChunks(int i0, int i1) {
+			for (int i = i0; i <= i1; i++) {
+				int* hist = &counts[i*kNumBuckets];
+				fill(hist, hist+kNumBuckets, 0);
+				const Edge* chunk = src + chunk_starts[i];
+				for (int j = 0; j < chunk_sizes[i]; j++) {
+					hist[Digit(chunk[j])]++;
+				}
+			}
+		}
+
+		void ScatterChunks(int i0, int i1) {
+			for (int i = i0; i <= i1; i++) {
+				int* offsets = &counts[i*kNumBuckets];
+				const Edge* chunk = src + chunk_starts[i];
+				for (int j = 0; j < chunk_sizes[i]; j++) {
+					dst[offsets[Digit(chunk[j])]++] = chunk[j];
+				}
+			}
+		}
+
+		// Returns true if every edge has the same digit in this pass,
+		// in which case the pass can be skipped
+		bool AllInOneBucket(int n) const {
+			for (int d = 0; d < kNumBuckets; d++) {
+				int total = 0;
+				for (int i = 0; i < num_chunks; i++) {
+					total += counts[i*kNumBuckets + d];
+				}
+				if (total > 0) return total == n;
+			}
+			return true;
+		}
+	};
+
+	int ExtractSortedEdges(const MatF& image,
+	                       const MatI& segmentation,
+	                       int num_threads,
+	                       vector<Edge>& edges,
+	                       vector<Edge>& buffer) {
+		ParallelEdgeSorter sorter(image, segmentation, edges, buffer, num_threads);
+		return sorter.Run();
+	}
+
+	FHSegmenter::FHSegmenter()
+		: num_threads(Worker::DefaultNumThreads()) {
 	}
 
-	FHSegmenter::FHSegmenter(const ImageBundle& image) {
+	FHSegmenter::FHSegmenter(const ImageBundle& image)
+		: num_threads(Worker::DefaultNumThreads()) {
 		Compute(image);
 	}
 
@@ -80,31 +277,19 @@ namespace indoor_context {
 			}
 		}
 
-		// Extract edges
-		vector<Edge>::iterator e = edges.begin();
-		TIMED("Get edges") for (int r = 0; r < h-1; r++) {
-			const float* row = image[r];
-			const float* nextrow = image[r+1];
-			const int* segrow = segmentation[r];
-			const int* nextsegrow = segmentation[r+1];
-			for (int c = 0; c < w-1; c++) {
-				// Add horizontal edge
-				if (segrow[c] != segrow[c+1]) {
-					e->src = segrow[c];
-					e->dest = segrow[c+1];
-					e->weight = fabsf(row[c] - row[c+1]);
-					e++;
-				}
-				e->src = segrow[c];
-				e->dest = nextsegrow[c];
-				e->weight = fabsf(row[c] - nextrow[c]);
-				e++;
-			}
+		// Extract and sort edges
+		int num_edges = 0;
+		if (*gvEdgeStrategy == "Sort") {
+			TIMED("Get edges") num_edges =
+				edges.empty() ? 0 : ExtractEdgeRows(image, segmentation, 0, h-2, &edges[0]);
+			TIMED("Sort") sort(edges.begin(), edges.begin()+num_edges);
+		} else if (*gvEdgeStrategy == "ParallelRadix") {
+			sorted_edges.resize(edges.size());
+			TIMED("Get and sort edges") num_edges =
+				ExtractSortedEdges(image, segmentation, num_threads, edges, sorted_edges);
+		} else {
+			CHECK(false) << "Unknown edge strategy: " << *gvEdgeStrategy;
 		}
-		const int num_edges = e - edges.begin();
-
-		// Sort edges by weight
-		TIMED("Sort") sort(edges.begin(), edges.begin()+num_edges);
 
 		// Agglomerate until done
 		uf.Reset(count);
@@ -17,6 +17,26 @@ struct Edge {
 	}
 };
 
+// Extract edges between rows r0..r1 (inclusive) and the rows below
+// them into OUT, which must have space for 2*(w-1) edges per
+// row. Returns the number of edges extracted.
+int ExtractEdgeRows(const MatF& image,
+                    const MatI& segmentation,
+                    int r0,
+                    int r1,
+                    Edge* out);
+
+// Extract all edges and radix sort them by weight using NUM_THREADS
+// threads. The result is identical to stable_sort() applied to the
+// output of ExtractEdgeRows. Both vectors must have space for
+// 2*(w-1)*(h-1) edges. The sorted edges are left in EDGES. Returns the
+// number of edges.
+int ExtractSortedEdges(const MatF& image,
+                       const MatI& segmentation,
+                       int num_threads,
+                       vector<Edge>& edges,
+                       vector<Edge>& buffer);
+
 class FHSegmenter {
 public:
 	// The smoothed image, or empty if FHSegmenter.SmoothingSigma is 0
@@ -35,6 +55,9 @@ public:
 	VecI seg_counts;  // not to be confused with seg_sizes
 	UnionFind uf;
 	vector<Edge> edges;
+	vector<Edge> sorted_edges;  // scratch for the radix sort
+	// Number of threads used by the ParallelRadix edge strategy
+	int num_threads;
 
 	// Initialize the segmenter empty
 	FHSegmenter();
@@ -87,6 +87,7 @@ namespace indoor_context {
 		if (encountered_nan) {
 			DLOG << "Warning: NaN coordinates were computed during FillPolygon";
 		}
+		return count;
 	}
 
 	// Fill the specified polygon in poly. Clips the polygon to the image bounds
@@ -3,7 +3,9 @@
 #include "filters.h"
 #include "common_types.h"
 #include "hw_convolver.h"
+#include "fft_convolver.h"
 #include "worker.h"
+#include "thread_pool.h"
 
 #include "numeric_utils.tpp"
 #include "image_utils.tpp"
@@ -14,6 +16,13 @@ namespace indoor_context {
 
 lazyvar<string> gvDefaultParallelism("FilterBank.DefaultParallelism");
 
+// RunParallel splits each filter output into horizontal tiles of about
+// this many pixels
+static const int kTilePixels = 1 << 16;
+
+// Width of the column strips used by the general convolution kernel
+static const int kStripWidth = 512;
+
 template <typename T, typename S>
 T cast(S x) {
 	return static_cast<T>(x);
@@ -56,44 +65,121 @@ int LinearFilter::RunAt(const MatF& input, int r, int c) const {
 void SeperatedFilter::RunSequential(const MatF& input, MatF& output) {
 	assert(input.Cols() <= output.Cols());
 	assert(input.Rows() <= output.Rows());
+	RunRows(input, 0, input.Rows()-1, output);
+}
+
+// Correlate n values with a symmetric kernel of radius R, where the
+// contribution of tap t comes from src[t]. Specialised for the small
+// Gaussian radii used by pyramids and smoothing.
+template <int R>
+static void CorrelateSymmetric(const float* const* src,
+                               const float* k,
+                               int n,
+                               float* out) {
+	const float* mid = src[R];
+	for (int c = 0; c < n; c++) {
+		float sum = k[R] * mid[c];
+		for (int t = 1; t <= R; t++) {
+			sum += k[R+t] * (src[R-t][c] + src[R+t][c]);
+		}
+		out[c] = sum;
+	}
+}
 
-	const int w = input.Cols();
-	const int h = input.Rows();
-	const int xrad = xmask.Size()/2;
-	const int yrad = ymask.Size()/2;
-
-	// Only reallocate if the temporary storage is smaller than the
-	// input image. In any other case we can simply use a sub-section
-	// of the temporary buffer and avoid the expensive reallocation.
-	if (temp.get() == NULL || temp->Cols() < w || temp->Rows() < h) {
-		if (temp.get() != NULL) {
-			DLOG << "Efficiency warning: Forced to reallocate"
-				" temp image in a SeperatedFilter\n";
+// As above for any kernel, over columns c0..c1-1. Taps are the outer
+// loop so that the inner loop runs over contiguous memory.
+static void CorrelateGeneral(const float* const* src,
+                             const float* k,
+                             int rad,
+                             int c0,
+                             int c1,
+                             float* out) {
+	for (int c = c0; c < c1; c++) {
+		out[c] = 0;
+	}
+	for (int t = 0; t <= 2*rad; t++) {
+		const float kt = k[t];
+		const float* in = src[t];
+		for (int c = c0; c < c1; c++) {
+			out[c] += kt * in[c];
 		}
-		temp.reset(new MatF(h, w));
 	}
+}
 
-	temp->Fill(0.0);
-	for (int r = 0; r < h; r++) {
-		const float* inrow = input[r];
-		float* outp = (*temp)[r];
-		for (int c = 0; c < w; c++) {
-			for (int dc = -xrad; dc <= xrad; dc++) {
-				*outp += xmask[dc+xrad] * inrow[ Clamp(c+dc, 0, w-1) ];
-			}
-			outp++;
+static void Correlate(const float* const* src,
+                      const float* k,
+                      int rad,
+                      bool symmetric,
+                      int n,
+                      float* out) {
+	if (symmetric) {
+		switch (rad) {
+		case 1: CorrelateSymmetric<1>(src, k, n, out); return;
+		case 2: CorrelateSymmetric<2>(src, k, n, out); return;
+		case 3: CorrelateSymmetric<3>(src, k, n, out); return;
+		case 4: CorrelateSymmetric<4>(src, k, n, out); return;
 		}
 	}
+	// Work in strips so that the output stays in cache across taps
+	for (int c0 = 0; c0 < n; c0 += kStripWidth) {
+		CorrelateGeneral(src, k, rad, c0, min(c0+kStripWidth, n), out);
+	}
+}
+
+// Convert a mask to float and determine whether it is symmetric
+static bool PrepareMask(const VecD& mask, vector<float>& out) {
+	const int n = mask.Size();
+	out.resize(n);
+	bool symmetric = true;
+	for (int i = 0; i < n; i++) {
+		out[i] = mask[i];
+		symmetric &= (mask[i] == mask[n-1-i]);
+	}
+	return symmetric;
+}
 
-	output.Fill(0.0);
-	for (int r = 0; r < h; r++) {
-		float* outp = output[r];
-		for (int c = 0; c < w; c++) {
-			for (int dr = -yrad; dr <= yrad; dr++) {
-				*outp += ymask[dr+yrad] * (*temp)[ Clamp(r+dr, 0, h-1) ][c];
+void SeperatedFilter::RunRows(const MatF& input, int r0, int r1,
+                              MatF& output, int out_offset) const {
+	const int w = input.Cols();
+	const int h = input.Rows();
+	const int xrad = xmask.Size()/2;
+	const int yrad = ymask.Size()/2;
+	if (r1 < r0 || w == 0) return;
+
+	vector<float> kx, ky;
+	const bool xsym = PrepareMask(xmask, kx);
+	const bool ysym = PrepareMask(ymask, ky);
+
+	// The horizontal pass writes each input row into a ring of 2*yrad+1
+	// rows, which holds exactly the rows needed for one output row.
+	// Each input row is filtered once and the ring stays in cache.
+	const int ring_size = 2*yrad+1;
+	MatF ring(ring_size, w);
+	vector<float> padded(w + 2*xrad);
+	vector<const float*> src(max(2*xrad, 2*yrad) + 1);
+	int next_row = max(r0-yrad, 0);  // next input row for the horizontal pass
+
+	for (int r = r0; r <= r1; r++) {
+		// Horizontal pass up to the last row this output row depends on
+		for (; next_row <= min(r+yrad, h-1); next_row++) {
+			const float* inrow = input[next_row];
+			// Replicate the border pixels so that the kernel needs no clamping
+			for (int c = 0; c < xrad; c++) {
+				padded[c] = inrow[0];
+				padded[w+xrad+c] = inrow[w-1];
 			}
-			outp++;
+			copy(inrow, inrow+w, &padded[xrad]);
+			for (int t = 0; t <= 2*xrad; t++) {
+				src[t] = &padded[t];
+			}
+			Correlate(&src[0], &kx[0], xrad, xsym, w, ring[next_row % ring_size]);
+		}
+
+		// Vertical pass
+		for (int t = 0; t <= 2*yrad; t++) {
+			src[t] = ring[Clamp(r+t-yrad, 0, h-1) % ring_size];
 		}
+		Correlate(&src[0], &ky[0], yrad, ysym, w, output[r-out_offset]);
 	}
 }
 
@@ -105,10 +191,20 @@ void SeperatedFilter::RunOnHardware(HwConvolver& convolver, MatF& output) {
 
 // *** DiffFilter ***
 void DiffFilter::RunSequential(const MatF& input, MatF& output) {
-	ExpandBuffer(input.Cols(), input.Rows());
-	filter1->RunSequential(input, output);
-	filter2->RunSequential(input, *temp);
-	Subtract(output, *temp);
+	RunRows(input, 0, input.Rows()-1, output);
+}
+
+void DiffFilter::RunRows(const MatF& input, int r0, int r1, MatF& output) const {
+	MatF temp(r1-r0+1, input.Cols());
+	filter1->RunRows(input, r0, r1, output);
+	filter2->RunRows(input, r0, r1, temp, r0);
+	for (int r = r0; r <= r1; r++) {
+		float* outrow = output[r];
+		const float* temprow = temp[r-r0];
+		for (int c = 0; c < input.Cols(); c++) {
+			outrow[c] -= temprow[c];
+		}
+	}
 }
 
 void DiffFilter::RunOnHardware(HwConvolver& convolver, MatF& output) {
@@ -129,19 +225,11 @@ void DiffFilter::Subtract(MatF& x, const MatF& y) {
 	}
 }
 
-void DiffFilter::ExpandBuffer(int w, int h) {
-	// Only reallocate if the temporary storage is smaller than the
-	// input image. In any other case we can simply use a subset of the
-	// temporary buffer and avoid the expensive reallocation.
-	if (temp.get() == NULL || temp->Cols() < w || temp->Rows() < h) {
-		if (temp.get() != NULL) {
-			DLOG << "Efficiency warning: Reallocating image in DiffFilter\n";
-		}
-		temp.reset(new MatF(h, w));
-	}
+int DiffFilter::MaxRadius() const {
+	return max(max(filter1->xmask.Size(), filter1->ymask.Size()),
+	           max(filter2->xmask.Size(), filter2->ymask.Size())) / 2;
 }
 
-
 // *** GaussFunction ***
 double GaussFunction::operator()(double x) const {
 	return exp(-x*x / denom) / nrm1d;
@@ -194,13 +282,55 @@ DiffFilter* GaborFunction::MakeSeperatedFilter() const {
 }
 
 // *** FilterBank ***
-FilterBank::FilterBank() : nworkers(0) {
+
+// A horizontal strip of the output of one filter, used to divide work
+// between threads
+struct FilterTile {
+	const DiffFilter* filter;
+	const MatF* input;
+	MatF* output;
+	int r0, r1;  // inclusive
+};
+
+// Allocate an output for each filter and append tiles covering them
+static void AddFilterTiles(const vector<shared_ptr<DiffFilter> >& filters,
+                           const MatF& input,
+                           vector<shared_ptr<MatF> >* outputs,
+                           vector<FilterTile>& tiles) {
+	const int h = input.Rows();
+	const int tile_rows = max(1, kTilePixels / max(input.Cols(), 1));
+	for (int j = 0; j < filters.size(); j++) {
+		outputs->push_back(make_shared_ptr(new MatF(input.Rows(), input.Cols())));
+		for (int r0 = 0; r0 < h; r0 += tile_rows) {
+			FilterTile tile;
+			tile.filter = filters[j].get();
+			tile.input = &input;
+			tile.output = outputs->back().get();
+			tile.r0 = r0;
+			tile.r1 = min(r0+tile_rows, h) - 1;
+			tiles.push_back(tile);
+		}
+	}
+}
+
+// Run tiles i0..i1 (inclusive)
+static void RunFilterTile(const FilterTile& tile) {
+	tile.filter->RunRows(*tile.input, tile.r0, tile.r1, *tile.output);
 }
 
-FilterBank::~FilterBank() {
-	for (int i = 0; i < nworkers; i++) {
-		workers[i].Join();
+// Run each tile as a separate job so that threads which finish their
+// tiles early (e.g. on the coarse pyramid levels) pick up more work
+static void RunFilterTilesInPool(const vector<FilterTile>& tiles) {
+	if (tiles.empty()) return;
+	const int num_threads = Clamp<int>(Worker::DefaultNumThreads(), 1, tiles.size());
+	thread_pool pool(num_threads);
+	for (int i = 0; i < tiles.size(); i++) {
+		pool.add(bind(&RunFilterTile, boost::cref(tiles[i])));
 	}
+	pool.join();
+}
+
+FilterBank::FilterBank() {
 }
 
 void FilterBank::RunOneFilter(int filter,
@@ -232,29 +362,48 @@ void FilterBank::RunOnHardware(const MatF& input,
 	}
 }
 
-void FilterBank::RunParallel(const MatF& input,
-                             vector<shared_ptr<MatF> >* output) const {
-	// We must only have one thread per filter at any one time since the
-	// filters are not thread-safe (they store contain temporary buffers
-	// used during the convolutions).
-	if (nworkers != filters.size()) {
-		workers.reset(new Worker[filters.size()]);
-		nworkers = filters.size();
+void FilterBank::RunFFT(const MatF& input,
+                        vector<shared_ptr<MatF> >* outputs) const {
+	// The transformed kernels depend on the input size, so keep one
+	// convolver for each size (i.e. for each pyramid level)
+	shared_ptr<FFTConvolver>& fft = fft_convolvers[make_pair(input.Cols(), input.Rows())];
+	if (!fft) {
+		int max_rad = 0;
+		for (int j = 0; j < filters.size(); j++) {
+			max_rad = max(max_rad, filters[j]->MaxRadius());
+		}
+		fft.reset(new FFTConvolver(input.Cols(), input.Rows(), max_rad));
+		for (int j = 0; j < filters.size(); j++) {
+			fft->AddDiffKernel(filters[j]->filter1->xmask,
+			                   filters[j]->filter1->ymask,
+			                   filters[j]->filter2->xmask,
+			                   filters[j]->filter2->ymask);
+		}
 	}
+	CHECK_EQ(fft->num_kernels(), filters.size())
+		<< "Filters were changed after RunFFT was first called";
 
-	// Do the filtering
+	// Transform the input once, then apply the filters two at a time
+	fft->LoadImage(input);
+	const int first = outputs->size();
 	for (int j = 0; j < filters.size(); j++) {
-		output->push_back(make_shared_ptr(new MatF));
-		workers[j].Add(bind(&FilterBank::RunOneFilter,
-												this, j, ref(input), ref(*output->back())));
+		outputs->push_back(make_shared_ptr(new MatF));
 	}
-
-	// Wait for the jobs to finish
-	for (int i = 0; i < nworkers; i++) {
-		workers[i].Wait();
+	for (int j = 0; j+1 < filters.size(); j += 2) {
+		fft->ConvolvePair(j, j+1, *(*outputs)[first+j], *(*outputs)[first+j+1]);
+	}
+	if (filters.size() % 2 == 1) {
+		fft->Convolve(filters.size()-1, *outputs->back());
 	}
 }
 
+void FilterBank::RunParallel(const MatF& input,
+                             vector<shared_ptr<MatF> >* outputs) const {
+	vector<FilterTile> tiles;
+	AddFilterTiles(filters, input, outputs, tiles);
+	RunFilterTilesInPool(tiles);
+}
+
 
 // *** FilterPyramid ***
 FilterPyramid::FilterPyramid() : num_scales(0) {
@@ -302,16 +451,34 @@ void FilterPyramid::RunOnHardware(const MatF& input,
 	}
 }
 
+void FilterPyramid::RunFFT(const MatF& input,
+                           vector<shared_ptr<MatF> >* outputs) const {
+	CHECK_GT(num_scales, 0);
+	scoped_ptr<MatF> level;
+	const MatF* cur = &input;
+	for (int i = 0; i < num_scales; i++) {
+		filter_bank.RunFFT(*cur, outputs);
+		level.reset(NextLevel(*cur));
+		cur = level.get();
+	}
+}
+
 void FilterPyramid::RunParallel(const MatF& input,
 																vector<shared_ptr<MatF> >* outputs) const {
 	CHECK_GT(num_scales, 0);
+	// Build the whole pyramid first so that all levels can be filtered
+	// together
 	vector<shared_ptr<MatF> > pyramid;
+	vector<FilterTile> tiles;
 	const MatF* cur = &input;
 	for (int i = 0; i < num_scales; i++) {
-		filter_bank.RunParallel(*cur, outputs);
-		pyramid.push_back(make_shared_ptr(NextLevel(*cur)));
-		cur = pyramid.back().get();
+		AddFilterTiles(filter_bank.filters, *cur, outputs, tiles);
+		if (i+1 < num_scales) {
+			pyramid.push_back(make_shared_ptr(NextLevel(*cur)));
+			cur = pyramid.back().get();
+		}
 	}
+	RunFilterTilesInPool(tiles);
 }
 
 
@@ -342,10 +509,12 @@ void GaborFilters::Run(const MatF& input) {
 }
 
 void GaborFilters::Run(const MatF& input, const string& strategy) {
-	if (strategy == "CPU-Sequential") {
+	if (strategy == "CPU-Sequential" || strategy == "CPU") {
 		RunSequential(input);
-	} else if (strategy == "CPU-Parallel") {
+	} else if (strategy == "CPU-Parallel" || strategy == "CPUParallel") {
 		RunParallel(input);
+	} else if (strategy == "CPU-FFT" || strategy == "CPUFFT") {
+		RunFFT(input);
 	} else if (strategy == "GPU") {
 		RunParallel(input);
 	} else {
@@ -371,6 +540,11 @@ void GaborFilters::RunOnHardware(const MatF& input) {
 	pyramid.RunOnHardware(input, &responses);
 }
 
+void GaborFilters::RunFFT(const MatF& input) {
+	responses.clear();
+	pyramid.RunFFT(input, &responses);
+}
+
 
 
 
@@ -2,14 +2,15 @@
 
 #include <cmath>
 #include <iostream>
+#include <map>
 
 #include <boost/shared_ptr.hpp>
 
 #include "common_types.h"
 
 namespace indoor_context {
-class Worker;
 class HwConvolver;
+class FFTConvolver;
 using boost::shared_ptr;
 
 // Represents a filter that takes an input image and produces an
@@ -51,12 +52,10 @@ public:
 };
 
 // Represents a filter that uses two 1D filters: one in the X
-// direction and one in the Y direction. NOT THREAD SAFE (due to use
-// of "temp" member)
+// direction and one in the Y direction. Thread safe: each invokation
+// uses its own buffer for intermediate results.
 class SeperatedFilter;
 class SeperatedFilter : public Filter2D {
-private:
-	scoped_ptr<MatF> temp;  // used for storing intermediate results
 public:
 	VecD xmask;
 	VecD ymask;
@@ -71,6 +70,10 @@ public:
 	  ymask(ys) { }
 	virtual void RunSequential(const MatF& input, MatF& output);
 	virtual void RunOnHardware(HwConvolver& convolver, MatF& output);
+	// Compute output rows r0..r1 (inclusive) only. Output row r is
+	// written to output[r-out_offset].
+	void RunRows(const MatF& input, int r0, int r1,
+	             MatF& output, int out_offset=0) const;
 
 	template<typename XFunc, typename YFunc>
 	static SeperatedFilter* MakeFromFuncs(int xrad, int yrad, XFunc xf, YFunc yf) {
@@ -86,12 +89,10 @@ public:
 };
 
 // Represents a filter that takes the signed difference between two
-// filters. NOT THREAD SAFE (due to use of "temp1" and "temp2" members)
+// filters. Thread safe, like SeperatedFilter.
 class DiffFilter : public Filter2D {
-private:
 public:
 	scoped_ptr<SeperatedFilter> filter1, filter2;
-	scoped_ptr<MatF> temp;
 
 	// Note that this constructor takes ownership of the two filters
 	DiffFilter(SeperatedFilter* a, SeperatedFilter* b) :
@@ -100,8 +101,11 @@ public:
 	virtual void RunSequential(const MatF& input, MatF& output);
 
 	virtual void RunOnHardware(HwConvolver& convolver, MatF& output);
+	// Compute output rows r0..r1 (inclusive) only
+	void RunRows(const MatF& input, int r0, int r1, MatF& output) const;
 	static void Subtract(MatF& x, const MatF& y);
-	void ExpandBuffer(int min_width, int min_height);
+	// Get the largest mask radius of either filter in either direction
+	int MaxRadius() const;
 };
 
 // Represents a gaussian of two variables
@@ -143,24 +147,22 @@ public:
 	// The child filters
 	vector<shared_ptr<DiffFilter> > filters;
 
-	// Number of workers for parallel impl
-	mutable int nworkers;
-	// The array of workers (only used for RunParallel)
-	mutable scoped_array<Worker> workers;
 	// The hardware handle for CUDA implementation
 	mutable scoped_ptr<HwConvolver> hw;
+	// The frequency domain convolvers for each input size (only used
+	// for RunFFT). Each holds the transformed filter kernels.
+	mutable map<pair<int,int>, shared_ptr<FFTConvolver> > fft_convolvers;
 
 	// Initialize a filter bank with the specified nubmer of scales
 	FilterBank();
-	// Kill the worker threads when this filterbank is destroyed
-	~FilterBank();
 
 	// Get the number of output images to be produced
 	inline int size() const { return filters.size(); }
 	// Run the filter bank, storing output images in the supplied vector
 	void RunSequential(const MatF& input, vector<shared_ptr<MatF> >* output) const;
 	// Run the filter bank using multiple threads. Exactly the same
-	// result as above, but faster.
+	// result as above, but faster. Each filter is split into row tiles
+	// so that all threads are kept busy even for small banks.
 	void RunParallel(const MatF& input,
 	                 vector<shared_ptr<MatF> >* output) const;
 	// Run the filter bank using multiple threads. Same result as above
@@ -168,6 +170,10 @@ public:
 	// hardware).
 	void RunOnHardware(const MatF& input,
 	                   vector<shared_ptr<MatF> >* output) const;
+	// Run the filter bank in the frequency domain. Same result as
+	// RunSequential up to rounding error.
+	void RunFFT(const MatF& input,
+	            vector<shared_ptr<MatF> >* output) const;
 private:
 	void RunOneFilter(int filter,
 	                  const MatF& input,
@@ -196,12 +202,16 @@ public:
 	// Run the filter, storing output images in the supplied vector
 	void RunSequential(const MatF& input,
 										 vector<shared_ptr<MatF> >* output) const;
-	// Run the filter using multiple threads
+	// Run the filter using multiple threads. All levels are filtered
+	// concurrently.
 	void RunParallel(const MatF& input,
 	                 vector<shared_ptr<MatF> >* output) const;
 	// Run the filters using multiple threads.
 	void RunOnHardware(const MatF& input,
 	                   vector<shared_ptr<MatF> >* output) const;
+	// Run the filters in the frequency domain
+	void RunFFT(const MatF& input,
+	            vector<shared_ptr<MatF> >* output) const;
 	// Low-pass and sub-sample, caller owns returned memory
 	MatF* NextLevel(const MatF& cur) const;
 
@@ -238,6 +248,9 @@ public:
 	// (except for perhaps small differences arising from hardware
 	// differences)
 	void RunOnHardware(const MatF& input);
+	// Run the filter bank in the frequency domain. Same result as
+	// RunSequential up to rounding error.
+	void RunFFT(const MatF& input);
 };
 
 // Smooth an image with a gaussian kernel of radius sigma
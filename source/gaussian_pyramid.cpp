@@ -1,5 +1,7 @@
 #include "gaussian_pyramid.h"
 
+#include <algorithm>
+
 #include "filters.h"
 #include "timer.h"
 
@@ -18,24 +20,28 @@ namespace indoor_context {
 	}
 
 	void GaussianPyramid::ComputeLevels(const MatF& input, int n) {
+		CHECK_GT(n, 0);
 		levels.resize(n);
-		buffers.resize(n-1);
+		for (int i = 0; i < n; i++) {
+			if (levels[i] == NULL) {
+				levels[i].reset(new MatF);
+			}
+		}
 
-		if (levels[0] == NULL) {
-			levels[0].reset(new MatF);
+		// Copy row by row so that the existing buffer is re-used
+		levels[0]->Resize(input.Rows(), input.Cols());
+		for (int r = 0; r < input.Rows(); r++) {
+			copy(input[r], input[r]+input.Cols(), (*levels[0])[r]);
 		}
-		*levels[0] = input;  // Copy entire matrix
 
+		// Each smoothed level is only needed until it has been
+		// downsampled, so one buffer serves all levels
 		for (int i = 1; i < n; i++) {
 			Vec2I size = matrix_size(*levels[i-1]);
-			buffers[i-1].Resize(size[1], size[0]);
-			lowpass->RunSequential(*levels[i-1], buffers[i-1]);
-			if (levels[i] == NULL) {
-				levels[i].reset(new MatF(size[1]/2, size[0]/2));
-			} else {
-				levels[i]->Resize(size[1]/2, size[0]/2);  // will only re-allocate if necessary
-			}
-			Downsample(buffers[i-1], 2, *levels[i]);
+			smoothed.Resize(size[1], size[0]);
+			lowpass->RunSequential(*levels[i-1], smoothed);
+			levels[i]->Resize(size[1]/2, size[0]/2);  // will only re-allocate if necessary
+			Downsample(smoothed, 2, *levels[i]);
 		}
 	}
 
@@ -60,38 +66,121 @@ namespace indoor_context {
 	}
 
 	void GaussianPyramid::ReleaseBuffers() {
-		buffers.clear();
+		smoothed.Resize(0, 0);
+		slices.clear();
 	}
 
+	// Compute pixel C in row R of Upsample(level, K, ...) from the two
+	// level rows that it interpolates between. This is the same
+	// arithmetic as Upsample() so that the results are identical.
+	// Columns past the end of the upsampled image are clamped.
+	static inline float UpsamplePixel(const float* inrow1, const float* inrow2,
+														 int k, int u, int c, int level_cols) {
+		if (c/k >= level_cols-1) {
+			const float A = (k-u) * inrow1[level_cols-1];
+			const float C = u * inrow2[level_cols-1];
+			return (A+C) / k;
+		} else {
+			const int t = c%k;
+			const float A = (k-t) * (k-u) * inrow1[c/k];
+			const float B = t * (k-u) * inrow1[c/k+1];
+			const float C = (k-t) * u * inrow2[c/k];
+			const float D = t * u * inrow2[c/k+1];
+			return (A+B+C+D) / (k*k);
+		}
+	}
 
+	float GaussianPyramid::SampleSlice(int level, int x, int y) const {
+		CHECK_INDEX(level, levels);
+		const MatF& base = *levels[0];
+		const MatF& input = *levels[level];
+		x = Clamp(x, 0, base.Cols()-1);
+		y = Clamp(y, 0, base.Rows()-1);
+		if (level == 0) {
+			return input[y][x];
+		}
 
-	void PyramidFeatureGen::Compute(const MatF& input, int num_scales, double nbr_dist) {
-		TIMED("Generate pyramid") pyramid.ComputeCube(input, num_scales);
-		
-		features.clear();
-		nbr_features.resize(num_scales*4);
-		int k = 0;
+		const int k = 1 << level;
+		const int r = min(y/k, input.Rows()-1);
+		const float* inrow1 = input[r];
+		const float* inrow2 = (r == input.Rows()-1) ? inrow1 : input[r+1];
+		return UpsamplePixel(inrow1, inrow2, k, y%k, x, input.Cols());
+	}
+
+	void GaussianPyramid::SampleSlice(int level, int x0, int y0, int w, int h,
+																		MatF& out) const {
+		CHECK_INDEX(level, levels);
+		const MatF& base = *levels[0];
+		const MatF& input = *levels[level];
+		const int k = 1 << level;
+		const int maxx = base.Cols()-1;
+		const int maxy = base.Rows()-1;
+
+		out.Resize(h, w);
+		for (int y = 0; y < h; y++) {
+			const int yy = Clamp(y0+y, 0, maxy);
+			float* outrow = out[y];
+			if (level == 0) {
+				const float* inrow = input[yy];
+				for (int x = 0; x < w; x++) {
+					outrow[x] = inrow[Clamp(x0+x, 0, maxx)];
+				}
+			} else {
+				const int r = min(yy/k, input.Rows()-1);
+				const float* inrow1 = input[r];
+				const float* inrow2 = (r == input.Rows()-1) ? inrow1 : input[r+1];
+				for (int x = 0; x < w; x++) {
+					outrow[x] = UpsamplePixel(inrow1, inrow2, k, yy%k,
+																		Clamp(x0+x, 0, maxx), input.Cols());
+				}
+			}
+		}
+	}
 
-		TIMED("Generate translations") 
-		for (int i = 0; i < num_scales; i++) {
-			int scale = nbr_dist * (1<<i);
 
-			// No translation
-			features.push_back(&pyramid.slices[i]);
 
+	void PyramidFeatureGen::Compute(const MatF& input, int nscales, double nbr_dist) {
+		TIMED("Generate pyramid") pyramid.ComputeLevels(input, nscales);
+		num_scales = nscales;
+
+		offsets.clear();
+		for (int i = 0; i < num_scales; i++) {
+			int scale = nbr_dist * (1<<i);
+			offsets.push_back(makeVector(0, 0));  // No translation
 			for (int t = -1; t <= 1; t+=2) {
-				// Horizontal translation +/- T
-				nbr_features[k].Resize(input.Rows(), input.Cols());
-				features.push_back(&nbr_features[k]);
-				ShiftHoriz(pyramid.slices[i], nbr_features[k], t*scale);
-				k++;
-
-				// Vertical translation +/- T
-				nbr_features[k].Resize(input.Rows(), input.Cols());
-				features.push_back(&nbr_features[k]);
-				ShiftVert(pyramid.slices[i], nbr_features[k], t*scale);
-				k++;
+				offsets.push_back(makeVector(t*scale, 0));  // Horizontal translation +/- T
+				offsets.push_back(makeVector(0, t*scale));  // Vertical translation +/- T
 			}
 		}
 	}
+
+	void PyramidFeatureGen::ComputeDense(const MatF& input, int nscales, double nbr_dist) {
+		Compute(input, nscales, nbr_dist);
+		features.clear();
+		feature_buffers.resize(num_features());
+		TIMED("Sample features")
+		for (int i = 0; i < num_features(); i++) {
+			SampleTile(i, 0, 0, input.Cols(), input.Rows(), feature_buffers[i]);
+			features.push_back(&feature_buffers[i]);
+		}
+	}
+
+	float PyramidFeatureGen::Sample(int feature, int x, int y) const {
+		CHECK_INDEX(feature, offsets);
+		const Vec2I& d = offsets[feature];
+		return pyramid.SampleSlice(feature/5, x+d[0], y+d[1]);
+	}
+
+	void PyramidFeatureGen::Sample(int x, int y, float* out) const {
+		for (int i = 0; i < num_features(); i++) {
+			out[i] = Sample(i, x, y);
+		}
+	}
+
+	void PyramidFeatureGen::SampleTile(int feature, int x0, int y0, int w, int h,
+																		 MatF& out) const {
+		CHECK_INDEX(feature, offsets);
+		const Vec2I& d = offsets[feature];
+		pyramid.SampleSlice(feature/5, x0+d[0], y0+d[1], w, h, out);
+	}
 }
@@ -7,19 +7,18 @@
 namespace indoor_context {
 	class SeperatedFilter;
 
-	// Represents a gaussian pyramid
+	// Represents a gaussian pyramid. Level buffers are kept between
+	// calls so that computing pyramids for a sequence of equally sized
+	// frames does not allocate.
 	class GaussianPyramid {
 	public:
 		// The Gaussian filter
 		scoped_ptr<SeperatedFilter> lowpass;
 		// The levels of the pyramid
 		vector<boost::shared_ptr<MatF> > levels;
-		// The smoothed versions of each pyramid level. This vector has
-		// one fewer elements than the one above since the last level
-		// doesn't need to be smoothed.
-		boost::ptr_vector<MatF> buffers;
 		// Each level of the pyramid upsampled to the full size. Only
-		// computed when ComputeCube() is called.
+		// computed when ComputeCube() is called. Prefer SampleSlice(),
+		// which computes only the pixels that are needed.
 		boost::ptr_vector<MatF> slices;
 
 		// Empty constructor and destructor for scoped_ptr (ugh)
@@ -30,25 +29,59 @@ namespace indoor_context {
 		void ComputeLevels(const MatF& input, int n);
 		// Compute the levels, then upsample them each to the size of the original frame.
 		void ComputeCube(const MatF& input, int n);
-		// Clear buffers. This decreases memory consumption by 50% but
-		// increases time taken by Compute() as it will have to
-		// re-allocate buffers.
+		// Free the smoothing buffer and the slices. The levels are kept.
 		void ReleaseBuffers();
+
+		// Sample a level upsampled to the size of level 0 at one pixel.
+		// The result is identical to the corresponding pixel of
+		// slices[level]. Coordinates are clamped to the image.
+		float SampleSlice(int level, int x, int y) const;
+		// Sample a WxH tile of a level upsampled to the size of level 0.
+		// Pixel (x,y) in the output is sampled at (x0+x, y0+y), clamped
+		// to the image.
+		void SampleSlice(int level, int x0, int y0, int w, int h, MatF& out) const;
+	private:
+		// The smoothed version of the level being downsampled
+		MatF smoothed;
 	};
 
-	// Generates features using a gaussian pyramid
+	// Generates features using a gaussian pyramid. Each scale has five
+	// features: the upsampled pyramid level itself, then the level
+	// translated by -T horizontally, -T vertically, +T horizontally,
+	// and +T vertically. Features are sampled from the pyramid on
+	// demand, so nothing is stored at full resolution unless
+	// ComputeDense() is called.
 	class PyramidFeatureGen {
 	public:
-		// Pointers to all matrices (translated and non-translated)
-		vector<MatF*> features;
 		// The gaussian pyramid used for filtering
 		GaussianPyramid pyramid;
-		// The translated features
-		boost::ptr_vector<MatF> nbr_features;
+		// Pointers to all features. Only computed by ComputeDense().
+		vector<MatF*> features;
+		// Storage for the above
+		boost::ptr_vector<MatF> feature_buffers;
+
+		PyramidFeatureGen() : num_scales(0) { }
 
 		// Compute features. Second parameters is the number of gaussian
 		// pyramid levels to compute, the second is the number of pixels
 		// to compute neighbours at each level (scales with the pyramid)
 		void Compute(const MatF& input, int num_scales, double nbr_dist);
+		// Compute features as above, then sample each at every pixel
+		// into "features"
+		void ComputeDense(const MatF& input, int num_scales, double nbr_dist);
+
+		// Get the number of features
+		int num_features() const { return num_scales*5; }
+		// Sample one feature at one pixel
+		float Sample(int feature, int x, int y) const;
+		// Sample all features at one pixel. The output must have space
+		// for num_features() elements.
+		void Sample(int x, int y, float* out) const;
+		// Sample a WxH tile of one feature with top-left corner (x0,y0)
+		void SampleTile(int feature, int x0, int y0, int w, int h, MatF& out) const;
+	private:
+		int num_scales;
+		// Translations for each feature
+		vector<Vec2I> offsets;
 	};
 }
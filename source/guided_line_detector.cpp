@@ -1,5 +1,9 @@
 #include "guided_line_detector.h"
 
+#include <algorithm>
+
+#include <boost/thread/mutex.hpp>
+
 #include "common_types.h"
 #include "image_utils.h"
 #include "clipping.h"
@@ -31,6 +35,44 @@ void DrawAxes(ImageRGB<byte>& canvas, const PosedCamera& pc) {
 
 
 
+void UndistortMap::Compute(const ImageRef& sz, const CameraBase& cam) {
+	for (int i = 0; i < 3; i++) {
+		rays[i].Resize(sz.y, sz.x);
+	}
+	Vec3 retina_pt;
+	for (int y = 0; y < sz.y; y++) {
+		float* xrow = rays[0][y];
+		float* yrow = rays[1][y];
+		float* zrow = rays[2][y];
+		for (int x = 0; x < sz.x; x++) {
+			retina_pt = unit(unproject(cam.ImToRet(makeVector(1.0*x,y))));
+			xrow[x] = retina_pt[0];
+			yrow[x] = retina_pt[1];
+			zrow[x] = retina_pt[2];
+		}
+	}
+}
+
+// static
+shared_ptr<const UndistortMap> UndistortMap::GetShared(const ImageRef& sz,
+																											 const CameraBase& cam) {
+	typedef pair<vector<double>, pair<int, int> > Key;
+	static map<Key, shared_ptr<const UndistortMap> > cache;
+	static boost::mutex cache_mutex;
+
+	Key key(cam.GetParameterVector(), make_pair(sz.x, sz.y));
+	// Build the map while holding the lock since ATANCamera is not
+	// thread-safe and the same camera is typically shared between frames
+	boost::mutex::scoped_lock lock(cache_mutex);
+	shared_ptr<const UndistortMap>& entry = cache[key];
+	if (!entry) {
+		shared_ptr<UndistortMap> m(new UndistortMap);
+		m->Compute(sz, cam);
+		entry = m;
+	}
+	return entry;
+}
+
 int GuidedLineDetector::GetBinForTheta(double theta, int assoc) {
 	double t = Ring(theta+theta_offsets[assoc], M_PI) / theta_spans[assoc];
 	return floori(t*num_t_bins);
@@ -49,29 +91,19 @@ void GuidedLineDetector::Compute(const PosedImage& image) {
 }
 
 void GuidedLineDetector::ComputeUndist(const ImageRef& sz, const CameraBase& cam) {
-	// Precompute the undistort map. For some reason we can't avoid doing this
-	// every time. If we skip this every time undist[0].size() == sz then the
-	// detections seem to change from one to the next!
-	for (int i = 0; i < 3; i++) {
-		undist[i].Resize(sz.y, sz.x);
-	}
-	Vec3 retina_pt;
-	for (int y = 0; y < sz.y; y++) {
-		float* xrow = undist[0][y];
-		float* yrow = undist[1][y];
-		float* zrow = undist[2][y];
-		for (int x = 0; x < sz.x; x++) {
-			retina_pt = unit(unproject(cam.ImToRet(makeVector(1.0*x,y))));
-			xrow[x] = retina_pt[0];
-			yrow[x] = retina_pt[1];
-			zrow[x] = retina_pt[2];
-		}
+	if (use_undist_cache) {
+		undist = UndistortMap::GetShared(sz, cam);
+	} else {
+		shared_ptr<UndistortMap> m(new UndistortMap);
+		m->Compute(sz, cam);
+		undist = m;
 	}
 }
 
 void GuidedLineDetector::ComputeGradients() {
-	gradients.ComputeSobel(input->mono);
-	gradients.ComputeMagSqr();
+	const float kMagThresh = *gvMagThresh;
+	gradients.ComputeFused(input->mono, false);
+	gradients.ComputeEdgeList(kMagThresh*kMagThresh, edge_pixels);
 }
 
 void GuidedLineDetector::ComputeVptProjs() {
@@ -82,72 +114,86 @@ void GuidedLineDetector::ComputeVptProjs() {
 }
 
 void GuidedLineDetector::ComputeAssocs() {
-	// TODO: speed this up by getting Canny to store a vector
-	// of image locations with gradient magnitude above the threshold
+	// Pixels are processed in fixed-size batches laid out as separate
+	// arrays so that the inner loops over each batch vectorize.
+	static const int kBatchSize = 8;
 
 	// DistThresh is distance from point to line but we maximize
 	// projection of point onto line, so convert threshold.
-	const double kDistThresh = *gvDistThresh;
-	const double kProjThresh = sqrt(1.0 - kDistThresh*kDistThresh);
-	const double kMagThresh = *gvMagThresh;
-	const double kMagSqrThresh = kMagThresh * kMagThresh;
+	const float kDistThresh = *gvDistThresh;
+	const float kProjThresh = sqrt(1.0 - kDistThresh*kDistThresh);
 
 	assocs.Resize(input->ny(), input->nx());
+	assocs.Fill(-2);
 	for (int j = 0; j < 3; j++) {
 		responses[j].Resize(input->ny(), input->nx());
 		responses[j].Fill(0.0);
 	}
 
-	// Compute normalizing factors for efficiency
-	Vector<5> quad_norm[3];
+	float vpt[3][3];
 	for (int j = 0; j < 3; j++) {
-		const Vec3& v = image_vpts[j];
-		quad_norm[j] = makeVector(v[0]*v[0]+v[1]*v[1],
-				-2*v[0]*v[2],
-				v[2]*v[2],
-				-2*v[1]*v[2],
-				v[2]*v[2]);
+		for (int k = 0; k < 3; k++) {
+			vpt[j][k] = image_vpts[j][k];
+		}
 	}
 
 	CHECK_SAME_SIZE(*input, gradients.diffx);
 	CHECK_SAME_SIZE(*input, gradients.diffy);
 	CHECK_SAME_SIZE(*input, gradients.magnitude_sqr);
 
-	for (int y = 0; y < input->ny(); y++) {
-		// Determine vpt associations: this must be done in the
-		// raw image because we are computing errors in terms of
-		// pixels, which makes sense since this image is where the
-		// measurements were actually made.
-
-		// Watch out here, "x" and "y" have three seperate
-		// meanings!
-		const PixelF* dxrow = gradients.diffx[y];
-		const PixelF* dyrow = gradients.diffy[y];
-		const float* magrow = gradients.magnitude_sqr[y];
-		int* arow = assocs[y];
-		for (int x = 0; x < input->nx(); x++) {
-			if (magrow[x] > kMagSqrThresh) {
-				double norm = sqrt(magrow[x]);
-				double dx = dxrow[x].y/norm;
-				double dy = dyrow[x].y/norm;
-				double proj_max = kProjThresh;
-				int assoc = -1;
-				for (int j = 0; j < 3; j++) {
-					const Vec3& v = image_vpts[j];
-					const Vector<5>& n = quad_norm[j];
-					// We write out these dot products for (significant) efficiency
-					double line_norm = sqrt(n[0] + n[1]*x + n[2]*x*x + n[3]*y + n[4]*y*y);
-					double proj = abs(((v[0]-x*v[2])*(-dy) + (v[1]-y*v[2])*dx) / line_norm);
-					if (proj > proj_max) {
-						proj_max = proj;
-						assoc = j;
-					}
+	// Determine vpt associations: this must be done in the raw image
+	// because we are computing errors in terms of pixels, which makes
+	// sense since this image is where the measurements were actually
+	// made. Watch out here, "x" and "y" have three seperate meanings!
+	float xs[kBatchSize], ys[kBatchSize];
+	float dxs[kBatchSize], dys[kBatchSize], mags[kBatchSize];
+	float projs[3][kBatchSize];
+	const int n = edge_pixels.size();
+	for (int i0 = 0; i0 < n; i0 += kBatchSize) {
+		const int m = min(kBatchSize, n-i0);
+
+		// Gather the batch. Pad the tail with the last pixel so that
+		// the inner loops always run over the full batch.
+		for (int k = 0; k < kBatchSize; k++) {
+			const ImageRef& p = edge_pixels[i0 + min(k, m-1)];
+			const float magsqr = gradients.magnitude_sqr[p.y][p.x];
+			mags[k] = sqrt(magsqr);
+			xs[k] = p.x;
+			ys[k] = p.y;
+			dxs[k] = gradients.diffx[p.y][p.x].y / mags[k];
+			dys[k] = gradients.diffy[p.y][p.x].y / mags[k];
+		}
+
+		// Score each vanishing point for the whole batch
+		for (int j = 0; j < 3; j++) {
+			const float* v = vpt[j];
+			float* proj = projs[j];
+			for (int k = 0; k < kBatchSize; k++) {
+				// (a,b) is the direction from the pixel towards the vanishing
+				// point. Normalizing it directly, rather than through the
+				// expanded quadratic, avoids cancellation near finite
+				// vanishing points.
+				const float a = v[0] - xs[k]*v[2];
+				const float b = v[1] - ys[k]*v[2];
+				proj[k] = abs((a*(-dys[k]) + b*dxs[k]) / sqrt(a*a + b*b));
+			}
+		}
+
+		// Select the best vanishing point for each pixel
+		for (int k = 0; k < m; k++) {
+			float proj_max = kProjThresh;
+			int assoc = -1;
+			for (int j = 0; j < 3; j++) {
+				if (projs[j][k] > proj_max) {
+					proj_max = projs[j][k];
+					assoc = j;
 				}
-				responses[assoc][y][x] = (1.0+sqrt(magrow[x]))*pow(proj_max,10.0);
-				arow[x] = assoc;
-			} else {
-				arow[x] = -2;
 			}
+			const ImageRef& p = edge_pixels[i0+k];
+			if (assoc >= 0) {
+				responses[assoc][p.y][p.x] = (1.0+mags[k])*pow(proj_max,10.0f);
+			}
+			assocs[p.y][p.x] = assoc;
 		}
 	}
 }
@@ -157,7 +203,7 @@ int GuidedLineDetector::GetBin(int x, int y, int vpt_index) {
 	const Vec3& v1 = retina_vpts[ (vpt_index+1)%3 ];
 	const Vec3& v2 = retina_vpts[ (vpt_index+2)%3 ];
 	Vec3 p = unit(unproject(input->pc().camera().ImToRet(makeVector(1.0*x,y))));
-	//Vec3 p = makeVector(undist[0][y][x], undist[1][y][x], undist[2][y][x]);
+	//Vec3 p = makeVector(undist->rays[0][y][x], undist->rays[1][y][x], undist->rays[2][y][x]);
 	// Unroll these dot products for (significant) efficiency
 	double d0 = p[0]*v0[0] + p[1]*v0[1] + p[2]*v0[2];
 	double d1 = p[0]*v1[0] + p[1]*v1[1] + p[2]*v1[2];
@@ -168,9 +214,6 @@ int GuidedLineDetector::GetBin(int x, int y, int vpt_index) {
 }
 
 void GuidedLineDetector::ComputeHistograms() {
-	// TODO: speed this up by getting ComputeAssocs to store a vector
-	// of image locations that are actually associated
-
 	thetas.Resize(input->ny(), input->nx());
 	d0s.Resize(input->ny(), input->nx());
 	for (int i = 0; i < 3; i++) {
@@ -182,8 +225,8 @@ void GuidedLineDetector::ComputeHistograms() {
 	for (int i = 0; i < 3; i++) {
 		histogram[i].resize(num_t_bins);
 		BOOST_FOREACH(LineBin& bin, histogram[i]) {
-			bin.pixels.clear();
-			bin.pixels.reserve(max(input->nx(), input->ny()));  // worst-case size
+			bin.pixel_offset = 0;
+			bin.num_pixels = 0;
 			bin.start_d0 = INFINITY;
 			bin.end_d0 = -INFINITY;
 			bin.support = 0;
@@ -246,56 +289,73 @@ void GuidedLineDetector::ComputeHistograms() {
 	}
 
 
-	// Accumulate the histograms
-	for (int y = 0; y < input->ny(); y++) {
-		const int* arow = assocs[y];
-		const float* xrow = undist[0][y];
-		const float* yrow = undist[1][y];
-		const float* zrow = undist[2][y];
-		const float* magrow = gradients.magnitude_sqr[y];
-		float* trow = thetas[y];
-		float* d0row = d0s[y];
-		for (int x = 0; x < input->nx(); x++) {
-			// Compute angle in a plane normal to the vpt.
-			// This part must be done in the calibrated retina domain
-			// where the vanishing points are actually orthogonal to
-			// each other.
-			if (arow[x] >= 0) {
-				int assoc = arow[x];
-				// Expanding out this matrix multiplication significantly
-				// speeds up this inner loop.
-				const Vec3& v0 = retina_vpts[ assoc ];
-				const Vec3& v1 = retina_vpts[ (assoc+1)%3 ];
-				const Vec3& v2 = retina_vpts[ (assoc+2)%3 ];
-				const float& px = xrow[x];
-				const float& py = yrow[x];
-				const float& pz = zrow[x];
-				double d0 = px*v0[0] + py*v0[1] + pz*v0[2];
-				double d1 = px*v1[0] + py*v1[1] + pz*v1[2];
-				double d2 = px*v2[0] + py*v2[1] + pz*v2[2];
-				double theta = atan2(d1,d2) + M_PI;
-				double t = Ring(theta+theta_offsets[assoc], 2*M_PI) / theta_spans[assoc];
-				int t_bin = floori(t*num_t_bins);
-
-				d0row[x] = d0;
-				trow[x] = theta;
-
-				LineBin& bin = histogram[assoc][t_bin];
-				bin.support += sqrt(magrow[x]);
-				bin.pixels.push_back(LinePixel(d0, x, y));
-				if (d0 < bin.start_d0) {
-					bin.start_d0 = d0;
-					bin.start[0] = x;
-					bin.start[1] = y;
-				}
-				if (d0 > bin.end_d0) {
-					bin.end_d0 = d0;
-					bin.end[0] = x;
-					bin.end[1] = y;
-				}
-			}
+	// Accumulate the histograms. Only edge pixels can be associated
+	// with a vanishing point, and edge_pixels is in row-major order so
+	// pixels are added to each bin in the same order as a full scan.
+	edge_bins.resize(edge_pixels.size());
+	for (int i = 0; i < edge_pixels.size(); i++) {
+		const int& x = edge_pixels[i].x;
+		const int& y = edge_pixels[i].y;
+		const int assoc = assocs[y][x];
+		edge_bins[i] = -1;
+		if (assoc < 0) continue;
+
+		// Compute angle in a plane normal to the vpt.
+		// This part must be done in the calibrated retina domain
+		// where the vanishing points are actually orthogonal to
+		// each other.
+		// Expanding out this matrix multiplication significantly
+		// speeds up this inner loop.
+		const Vec3& v0 = retina_vpts[ assoc ];
+		const Vec3& v1 = retina_vpts[ (assoc+1)%3 ];
+		const Vec3& v2 = retina_vpts[ (assoc+2)%3 ];
+		const float& px = undist->rays[0][y][x];
+		const float& py = undist->rays[1][y][x];
+		const float& pz = undist->rays[2][y][x];
+		double d0 = px*v0[0] + py*v0[1] + pz*v0[2];
+		double d1 = px*v1[0] + py*v1[1] + pz*v1[2];
+		double d2 = px*v2[0] + py*v2[1] + pz*v2[2];
+		double theta = atan2(d1,d2) + M_PI;
+		double t = Ring(theta+theta_offsets[assoc], 2*M_PI) / theta_spans[assoc];
+		int t_bin = floori(t*num_t_bins);
+
+		d0s[y][x] = d0;
+		thetas[y][x] = theta;
+		edge_bins[i] = t_bin;
+
+		LineBin& bin = histogram[assoc][t_bin];
+		bin.support += sqrt(gradients.magnitude_sqr[y][x]);
+		bin.num_pixels++;
+		if (d0 < bin.start_d0) {
+			bin.start_d0 = d0;
+			bin.start[0] = x;
+			bin.start[1] = y;
+		}
+		if (d0 > bin.end_d0) {
+			bin.end_d0 = d0;
+			bin.end[0] = x;
+			bin.end[1] = y;
 		}
 	}
+
+	// Lay out the pixels for each histogram contiguously, grouped by bin
+	for (int i = 0; i < 3; i++) {
+		int offset = 0;
+		BOOST_FOREACH(LineBin& bin, histogram[i]) {
+			bin.pixel_offset = offset;
+			offset += bin.num_pixels;
+			bin.num_pixels = 0;  // re-counted below
+		}
+		bin_pixels[i].resize(offset);
+	}
+	for (int i = 0; i < edge_pixels.size(); i++) {
+		if (edge_bins[i] == -1) continue;
+		const int& x = edge_pixels[i].x;
+		const int& y = edge_pixels[i].y;
+		const int assoc = assocs[y][x];
+		LineBin& bin = histogram[assoc][edge_bins[i]];
+		bin_pixels[assoc][bin.pixel_offset + bin.num_pixels++] = LinePixel(d0s[y][x], x, y);
+	}
 }
 
 void GuidedLineDetector::ComputeSegments() {
@@ -303,8 +363,12 @@ void GuidedLineDetector::ComputeSegments() {
 	const double kMinSegLength = 25;  // in pixels
 
 	for (int i = 0; i < 3; i++) {
-		peaks[i].clear();
 		detections[i].clear();
+	}
+	ResetPixelPool(pixel_pool);
+
+	for (int i = 0; i < 3; i++) {
+		peaks[i].clear();
 
 		vector<LineBin>& hist = histogram[i];
 		for (int j = 0; j < num_t_bins; j++) {
@@ -322,25 +386,28 @@ void GuidedLineDetector::ComputeSegments() {
 				peaks[i].push_back(make_pair(t, j));
 
 				// Break the ray into line segments
-				sort_all(hist[j].pixels);
+				LinePixel* pix = GetBinPixels(i, j);
+				const int npix = hist[j].num_pixels;
+				sort(pix, pix+npix);
 				Vec2 dir = unit(hist[j].end - hist[j].start);
 				int j0 = 0;
-				const vector<LinePixel>& pix = hist[j].pixels;
-				for (int j = 1; j < pix.size(); j++) {
+				for (int j = 1; j < npix; j++) {
 					// proj_dist may be a small negative number because "dir" is
 					// computed from the two most distant pixels, which may not
 					// correspond exactly to the line specified by
 					// line.theta. proj_dist will never be large and negative.
 					double proj_dist = (pix[j].pos - pix[j-1].pos) * dir;
-					if (j == pix.size()-1 || proj_dist > kCutThresh) {
+					if (j == npix-1 || proj_dist > kCutThresh) {
 						Vec2 total_diff = pix[j-1].pos - pix[j0].pos;
 						double len = dir * total_diff;
 						if (len >= kMinSegLength) {
 							LineDetection det(unproject(pix[j0].pos), unproject(pix[j-1].pos));
 							det.axis = i;
+							const int offset = pixel_pool->size();
 							for (int k = j0; k < j; k++) {
-								det.pixels->push_back(round_pos(pix[k].pos));
+								pixel_pool->push_back(round_pos(pix[k].pos));
 							}
+							det.SetPixels(pixel_pool, offset, j-j0);
 							detections[i].push_back(det);
 						}
 						j0 = j;
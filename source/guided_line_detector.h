@@ -1,5 +1,6 @@
 #pragma once
 
+#include <map>
 #include <vector>
 
 #include "line_detector.h"
@@ -25,7 +26,24 @@ namespace indoor_context {
 		double support;
 		float start_d0, end_d0;
 		toon::Vector<2> start, end;
-		vector<LinePixel> pixels;
+		// The pixels in this bin are the interval
+		// [pixel_offset, pixel_offset+num_pixels) within
+		// GuidedLineDetector::bin_pixels for the bin's axis
+		int pixel_offset;
+		int num_pixels;
+	};
+
+	// Maps each pixel to a unit-length ray in retina coordinates
+	class UndistortMap {
+	public:
+		MatF rays[3];  // x, y, and z components of the ray for each pixel
+		// Compute the map by projecting every pixel through the camera
+		void Compute(const ImageRef& sz, const CameraBase& cam);
+		// Get a map for the given camera and image size. Maps are cached
+		// by camera parameters and image size, and shared between all
+		// callers. This function is thread-safe.
+		static shared_ptr<const UndistortMap> GetShared(const ImageRef& sz,
+																										const CameraBase& cam);
 	};
 
 	// Represents the vpt-targetted line detection algorithm
@@ -36,13 +54,17 @@ namespace indoor_context {
 
 		// Image gradients
 		Gradients gradients;
+		// Pixels with gradient magnitude above GuidedLineDetector.MagThresh
+		vector<ImageRef> edge_pixels;
 
 		// Projected vanishing points
 		Vec3 image_vpts[3];
 		Vec3 retina_vpts[3];
 
 		// Undistort map
-		MatF undist[3];
+		shared_ptr<const UndistortMap> undist;
+		// If true then undistort maps are shared via UndistortMap::GetShared
+		bool use_undist_cache;  // default is true
 
 		// Pixel-wise values
 		MatF responses[3];  // the agreement of each pixel with each vpt
@@ -58,6 +80,8 @@ namespace indoor_context {
 		int num_t_bins;
 		double theta_offsets[3], theta_spans[3];
 		vector<LineBin> histogram[3];
+		// Pixels for all bins of each histogram, grouped by bin
+		vector<LinePixel> bin_pixels[3];
 
 		// Histogram peaks as (theta, bin_index) pairs, listed by vanishing point
 		vector<pair<float, int> > peaks[3];
@@ -71,13 +95,20 @@ namespace indoor_context {
 		// The samples we selected to localise the vanishing points
 		vector<ImageRef> vpt_samples[3];
 
+		// Storage for the pixels of all detections
+		shared_ptr<PixelPool> pixel_pool;
+		// The histogram bin for each edge pixel, or -1 if unassociated
+		vector<int> edge_bins;
+
 		// Vizualization settings
 		bool draw_thick_lines;  // default is false
 
 		// Initialize empty
-		GuidedLineDetector() : draw_thick_lines(false) { } 
+		GuidedLineDetector()
+			: use_undist_cache(true), draw_thick_lines(false) { }
 		// Initialize and detect lines
-		GuidedLineDetector(const PosedImage& image) : draw_thick_lines(false) {
+		GuidedLineDetector(const PosedImage& image)
+			: use_undist_cache(true), draw_thick_lines(false) {
 			Compute(image);
 		}
 
@@ -86,7 +117,7 @@ namespace indoor_context {
 
 		// Compute the map from image to retina coordinates
 		void ComputeUndist(const ImageRef& sz, const CameraBase& cam);
-		// Compute image gradients
+		// Compute image gradients and the list of edge pixels
 		void ComputeGradients();
 		// Compute vanishing point locations in the image and retina
 		void ComputeVptProjs();
@@ -106,6 +137,11 @@ namespace indoor_context {
 		// Various utility functions
 		int GetBin(int x, int y, int vpt_index); // only for the outside world, not used internally
 		int GetBinForTheta(double theta, int assoc);
+		// Get the pixels in a histogram bin
+		inline LinePixel* GetBinPixels(int axis, int bin) {
+			LinePixel* begin = bin_pixels[axis].empty() ? NULL : &bin_pixels[axis][0];
+			return begin + histogram[axis][bin].pixel_offset;
+		}
 
 		// Draw functions
 		void DrawSceneAxes(ImageRGB<byte>& canvas);
@@ -11,8 +11,166 @@
 #include <VNL/sample.h>
 
 #include "common_types.h"
+#include "worker.h"
 
 namespace indoor_context {
+using boost::bind;
+using boost::cref;
+
+// Compute the squared norm of each row of M
+static void ComputeRowNorms(const MatF& m, VecF& norms) {
+	norms.Resize(m.Rows());
+	for (int i = 0; i < m.Rows(); i++) {
+		const float* row = m[i];
+		float sum = 0;
+		for (int j = 0; j < m.Cols(); j++) {
+			sum += row[j]*row[j];
+		}
+		norms[i] = sum;
+	}
+}
+
+// Assign the points pts[ids[i0..i1]] (inclusive) to the nearest
+// mean. Uses |x-w|^2 = |x|^2 - 2x.w + |w|^2, in which the first term is
+// the same for every mean and so is omitted.
+static void AssignRange(const MatF& pts,
+                        const MatF& means,
+                        const VecF& mean_norms,
+                        const int* ids,
+                        int* parents,
+                        int i0,
+                        int i1) {
+	const int d = pts.Cols();
+	for (int i = i0; i <= i1; i++) {
+		const float* x = pts[ids ? ids[i] : i];
+		float mindist = INFINITY;
+		int parent = 0;
+		for (int k = 0; k < means.Rows(); k++) {
+			const float* w = means[k];
+			float dot = 0;
+			for (int j = 0; j < d; j++) {
+				dot += x[j]*w[j];
+			}
+			float dist = mean_norms[k] - 2*dot;
+			if (dist < mindist) {
+				mindist = dist;
+				parent = k;
+			}
+		}
+		parents[i] = parent;
+	}
+}
+
+// Update the squared distance from each of pts[i0..i1] to its
+// nearest seed, given a new seed
+static void UpdateSeedDistsRange(const MatF& pts,
+                                 const float* seed,
+                                 float* mindists,
+                                 int i0,
+                                 int i1) {
+	const int d = pts.Cols();
+	for (int i = i0; i <= i1; i++) {
+		const float* x = pts[i];
+		float dist = 0;
+		for (int j = 0; j < d; j++) {
+			float delta = x[j] - seed[j];
+			dist += delta*delta;
+		}
+		if (dist < mindists[i]) {
+			mindists[i] = dist;
+		}
+	}
+}
+
+// Choose initial means using k-means++ seeding
+static void SeedPlusPlus(const MatF& pts, int ncomps, MatF& means) {
+	const int n = pts.Rows();
+	const int d = pts.Cols();
+	means.Resize(ncomps, d);
+	vector<float> mindists(n, INFINITY);
+	int next = rand() % n;
+	for (int k = 0; k < ncomps; k++) {
+		copy(pts[next], pts[next]+d, means[k]);
+		if (k+1 == ncomps) break;
+
+		// Sample the next seed with probability proportional to the
+		// squared distance to the nearest existing seed
+		ParallelPartition(n, bind(&UpdateSeedDistsRange,
+		                          cref(pts), means[k], &mindists[0], _1, _2));
+		double total = 0.0;
+		for (int i = 0; i < n; i++) {
+			total += mindists[i];
+		}
+		double r = total * rand() / RAND_MAX;
+		next = n-1;
+		for (int i = 0; i < n; i++) {
+			r -= mindists[i];
+			if (r <= 0 && mindists[i] > 0) {
+				next = i;
+				break;
+			}
+		}
+	}
+}
+
+void KMeans::EstimateMiniBatch(const MatF& pts,
+                               int ncomps,
+                               MatF& means,
+                               VecI& parents) {
+	const int n = pts.Rows();
+	const int d = pts.Cols();
+	CHECK_GE(n, ncomps);
+	CHECK_GT(ncomps, 0);
+
+	// Parameters
+	gvar3<int> gvBatchSize("KMeans.MiniBatchSize");
+	gvar3<int> gvNumIterations("KMeans.MiniBatchIterations");
+	const int batch_size = min(*gvBatchSize, n);
+
+	SeedPlusPlus(pts, ncomps, means);
+
+	// Each mean moves towards its assigned points with a learning rate of
+	// 1/(number of points assigned so far), so that it tracks the running
+	// average of its assigned points.
+	VecI counts(ncomps);
+	counts.Fill(0);
+	VecF mean_norms;
+	vector<int> batch(batch_size);
+	vector<int> batch_parents(batch_size);
+	for (int iter = 0; iter < *gvNumIterations; iter++) {
+		// Sample on this thread since rand() is not thread-safe
+		for (int i = 0; i < batch_size; i++) {
+			batch[i] = rand() % n;
+		}
+
+		// The batch is too small to be worth spawning threads for
+		ComputeRowNorms(means, mean_norms);
+		AssignRange(pts, means, mean_norms, &batch[0], &batch_parents[0], 0, batch_size-1);
+
+		for (int i = 0; i < batch_size; i++) {
+			const int k = batch_parents[i];
+			const float eta = 1.0f / ++counts[k];
+			const float* x = pts[batch[i]];
+			float* w = means[k];
+			for (int j = 0; j < d; j++) {
+				w[j] += eta * (x[j] - w[j]);
+			}
+		}
+	}
+
+	// Assign every point to its final mean
+	parents.Resize(n);
+	ComputeRowNorms(means, mean_norms);
+	ParallelPartition(n, bind(&AssignRange,
+	                          cref(pts), cref(means), cref(mean_norms),
+	                          static_cast<const int*>(NULL), &parents[0], _1, _2));
+
+	for (int k = 0; k < ncomps; k++) {
+		if (counts[k] == 0) {
+			DLOG << "Warning: K-Means component " << k << " has no support";
+		}
+	}
+}
 
 bool KMeans::Estimate(const vector<VecD>& pts,
                       int ncomps,
@@ -21,5 +21,15 @@ namespace indoor_context {
 												 int ncomps,
 												 vector<VecD>& out_means,
 												 MatD& out_responsibilities);
+
+		// Run mini-batch K-means (Sculley, 2010) on the rows of PTS,
+		// seeded with k-means++. Each iteration assigns a random batch of
+		// points and moves each mean towards its assigned points. The
+		// final assignment of all points runs in parallel. Write the cluster centres to the rows of OUT_MEANS and
+		// the nearest centre for each point to OUT_PARENTS.
+		static void EstimateMiniBatch(const MatF& pts,
+																	int ncomps,
+																	MatF& out_means,
+																	VecI& out_parents);
 	};
 }
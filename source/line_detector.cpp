@@ -2,6 +2,7 @@
 #include <iomanip>
 #include <queue>
 
+#include <boost/bind.hpp>
 #include <boost/foreach.hpp>
 
 #include <LU.h>
@@ -12,6 +13,7 @@
 #include "line_detector.h"
 #include "geom_utils.h"
 #include "canvas.h"
+#include "worker.h"
 
 #include "eigensystem2d.tpp"
 #include "numeric_utils.tpp"
@@ -19,11 +21,13 @@
 
 namespace indoor_context {
 	using namespace toon;
+	using boost::bind;
 
 	const lazyvar<float> gvMinCompSize("LineDetector.MinCompSize");
 	const lazyvar<float> gvMinCompSizePixels("LineDetector.MinCompSizePixels");
 	const lazyvar<int> gvNumOrientBins("LineDetector.NumOrientBins");
 	const lazyvar<int> gvOrientTol("LineDetector.OrientTol");
+	const lazyvar<int> gvNumBands("LineDetector.NumBands");
 
 	static const PixelRGB<byte> kSpuriousColor(255, 255, 255);
 
@@ -36,7 +40,7 @@ namespace indoor_context {
 																 const PixelRGB<byte>& color,
 																 const Vec2 offs,
 																 int thickness) const {
-		BOOST_FOREACH(const ImageRef& p, *pixels) {
+		BOOST_FOREACH(const ImageRef& p, pixels()) {
 			DrawSpot(canvas, makeVector(p.x,p.y)+offs, color, thickness);
 		}
 		DrawSpot(canvas, project(seg.start)+offs, color, thickness+1);
@@ -44,18 +48,44 @@ namespace indoor_context {
 	}
 
 
-	CannyLineDetector::CannyLineDetector() {
+	void LineDetection::SetPixels(const shared_ptr<const PixelPool>& pool,
+	                              int offset,
+	                              int n) {
+		CHECK_INTERVAL(offset, 0, pool->size());
+		CHECK_LE(offset+n, pool->size());
+		pixel_pool = pool;
+		pixel_offset = offset;
+		num_pixels = n;
 	}
 
-	CannyLineDetector::CannyLineDetector(const ImageBundle& image) {
+	void ResetPixelPool(shared_ptr<PixelPool>& pool) {
+		if (pool && pool.unique()) {
+			pool->clear();
+		} else {
+			pool.reset(new PixelPool);
+		}
+	}
+
+
+	CannyLineDetector::CannyLineDetector() : num_threads(0) {
+	}
+
+	CannyLineDetector::CannyLineDetector(const ImageBundle& image)
+		: num_threads(0) {
 		Compute(image);
 	}
 
+	int CannyLineDetector::NumThreadsFor(int n) const {
+		const int nt = num_threads > 0 ? num_threads : Worker::DefaultNumThreads();
+		return Clamp(nt, 1, max(n, 1));
+	}
+
 	void CannyLineDetector::Compute(const ImageBundle& image) {
 		detections.clear();
 		input = &image;
 		image.BuildMono();
 		// Run canny edge detector
+		canny.num_threads = num_threads;
 		canny.Compute(image.mono);
 		// Find connected components
 		FindComponents();
@@ -63,86 +93,198 @@ namespace indoor_context {
 		FitLines();
 	}
 
+	void CannyLineDetector::FindComponentBands(int b0, int b1) {
+		const int nx = component_map.Cols();
+		const int tol = *gvOrientTol;
+		queue<ImageRef> comp_queue;
+		for (int b = b0; b <= b1; b++) {
+			BandComponents& band = band_comps[b];
+			const int y0 = BandStart(b);
+			const int y1 = BandStart(b+1)-1;
+			band.pixels.clear();
+			band.starts.clear();
+			band.dirs.clear();
+
+			// BFS from each unlabelled edge pixel, without leaving the band
+			for (int i = band.edge_begin; i < band.edge_end; i++) {
+				const ImageRef& seed = canny.edge_list[i];
+				if (component_map[seed.y][seed.x] != -1) continue;
+
+				const int label = band.starts.size();
+				const int dir = canny.dir16[seed.y][seed.x];
+				const int* ringdistrow = ringdist[dir];
+				band.starts.push_back(band.pixels.size());
+				band.dirs.push_back(dir);
+				comp_queue.push(seed);
+				component_map[seed.y][seed.x] = label;
+
+				while (!comp_queue.empty()) {
+					const ImageRef p = comp_queue.front();
+					band.pixels.push_back(p);
+					comp_queue.pop();
+
+					for (int yy = max(p.y-1, y0); yy <= min(p.y+1, y1); yy++) {
+						for (int xx = max(p.x-1, 0); xx <= min(p.x+1, nx-1); xx++) {
+							if (!(xx == p.x && yy == p.y) &&
+									canny.edge_map[yy][xx] &&
+									component_map[yy][xx] == -1 &&
+									ringdistrow[ canny.dir16[yy][xx] ] <= tol) {
+								comp_queue.push(ImageRef(xx, yy));
+								component_map[yy][xx] = label;
+							}
+						}
+					}
+				}
+			}
+			band.starts.push_back(band.pixels.size());
+		}
+	}
+
 	void CannyLineDetector::FindComponents() {
 		int nx = canny.edge_map.Cols();
 		int ny = canny.edge_map.Rows();
 		const int max_dim = max(nx, ny);
 		const int min_size = max(max_dim * *gvMinCompSize, *gvMinCompSizePixels);
+		const int tol = *gvOrientTol;
 
 		// Prepare buffers
 		detections.clear();
-		seen.Resize(ny, nx);
-		seen.Fill(0);
+		component_map.Resize(ny, nx);
+		component_map.Fill(-1);
 		segment_map.Resize(ny, nx);
 		segment_map.Fill(-1);
 
 		// Cache RingDist output for speed
 		const int nbins = *gvNumOrientBins;
-		MatI ringdist(nbins, nbins);
+		ringdist.Resize(nbins, nbins);
 		for (int i = 0; i < nbins; i++) {
 			for (int j = 0; j < nbins; j++) {
 				ringdist[i][j] = RingDist<int>(i, j, nbins);
 			}
 		}
 
-		// BFS from each segment
-		const int tol = *gvOrientTol;
-		LineDetection curseg;
-		CHECK(comp_queue.empty()) << "comp_queue is not empty at start of line BFS";
-		BOOST_FOREACH(const ImageRef& p, canny.edge_list) {
-			const int dir = canny.dir16[p.y][p.x];
-			const int* ringdistrow = ringdist[dir];
-			if (seen[p.y][p.x] == 0) {
-				comp_queue.push(p);
-				seen[p.y][p.x] = 1;
-
-				curseg.pixels->clear();
-			
-				while (!comp_queue.empty()) {
-					const ImageRef& p = comp_queue.front();
-					curseg.pixels->push_back(p);
-					comp_queue.pop();
-				
-					for (int yy = max(p.y-1, 0); yy <= min(p.y+1, ny-1); yy++) {
-						for (int xx = max(p.x-1, 0); xx <= min(p.x+1, nx-1); xx++) {
-							if (!(xx == p.x && yy == p.y) &&
-									canny.edge_map[yy][xx] &&
-									seen[yy][xx] == 0 &&
-									ringdistrow[ canny.dir16[yy][xx] ] <= tol) {
-								comp_queue.push(ImageRef(xx, yy));
-								seen[yy][xx] = 1;
-							}
-						}
+		// Partition the edge list into bands. It is in row-major order so
+		// each band is a contiguous interval. The merge below is not
+		// exactly equivalent to a single flood fill, so the number of
+		// bands is fixed by configuration rather than by the number of
+		// threads, which keeps the output the same on every machine.
+		const int num_bands = Clamp(*gvNumBands, 1, max(ny, 1));
+		band_comps.resize(num_bands);
+		int i = 0;
+		const vector<ImageRef>& edges = canny.edge_list;
+		for (int b = 0; b < num_bands; b++) {
+			band_comps[b].edge_begin = i;
+			while (i < edges.size() && edges[i].y < BandStart(b+1)) i++;
+			band_comps[b].edge_end = i;
+		}
+
+		// Find components within each band
+		ParallelPartition(num_bands, NumThreadsFor(num_bands),
+		                  bind(&CannyLineDetector::FindComponentBands, this, _1, _2));
+
+		// Merge components across band borders. A component in the lower
+		// band joins the one above if the pixels that touch and the seeds
+		// of both components are all within tolerance of the upper seed.
+		// This approximates a flood fill that crossed the border.
+		comp_offsets.resize(num_bands+1);
+		comp_offsets[0] = 0;
+		for (int b = 0; b < num_bands; b++) {
+			comp_offsets[b+1] = comp_offsets[b] + band_comps[b].dirs.size();
+		}
+		const int num_comps = comp_offsets[num_bands];
+		comp_groups.Reset(num_comps);
+		vector<int> dirs(num_comps);
+		for (int b = 0; b < num_bands; b++) {
+			for (int k = 0; k < band_comps[b].dirs.size(); k++) {
+				dirs[comp_offsets[b]+k] = band_comps[b].dirs[k];
+			}
+		}
+		for (int b = 1; b < num_bands; b++) {
+			const int y = BandStart(b);
+			if (y <= 0 || y >= ny) continue;
+			for (int x = 0; x < nx; x++) {
+				if (component_map[y][x] == -1) continue;
+				const int lower = comp_offsets[b] + component_map[y][x];
+				for (int xx = max(x-1, 0); xx <= min(x+1, nx-1); xx++) {
+					if (component_map[y-1][xx] == -1) continue;
+					const int upper = comp_offsets[b-1] + component_map[y-1][xx];
+					const int upper_root = comp_groups.GetGroup(upper);
+					const int lower_root = comp_groups.GetGroup(lower);
+					const int* ringdistrow = ringdist[dirs[upper_root]];
+					if (upper_root != lower_root &&
+							ringdistrow[ canny.dir16[y][x] ] <= tol &&
+							ringdistrow[ canny.dir16[y-1][xx] ] <= tol &&
+							ringdistrow[ dirs[lower_root] ] <= tol) {
+						comp_groups.MergeMin(upper_root, lower_root);
 					}
 				}
 			}
-		
-			if (curseg.pixels->size() >= min_size) {
-				BOOST_FOREACH(const ImageRef& p, *curseg.pixels) {
-					segment_map[p.y][p.x] = detections.size();
+		}
+
+		// Count the pixels in each merged component
+		vector<int> sizes(num_comps, 0);
+		for (int b = 0; b < num_bands; b++) {
+			const vector<int>& starts = band_comps[b].starts;
+			for (int k = 0; k+1 < starts.size(); k++) {
+				sizes[comp_groups.GetGroup(comp_offsets[b]+k)] += starts[k+1]-starts[k];
+			}
+		}
+
+		// Create a detection for each large component. Roots are the
+		// components with the earliest seed, so detections are ordered by
+		// their seed in the edge list.
+		// Each detection gets a contiguous interval of the pixel pool.
+		ResetPixelPool(pixel_pool);
+		vector<int> det_index(num_comps, -1);
+		vector<int> det_fill;
+		int pool_size = 0;
+		for (int k = 0; k < num_comps; k++) {
+			if (comp_groups.GetGroup(k) == k && sizes[k] >= min_size) {
+				det_index[k] = detections.size();
+				detections.push_back(LineDetection());
+				det_fill.push_back(pool_size);
+				pool_size += sizes[k];
+			}
+		}
+		pixel_pool->resize(pool_size);
+		for (int i = 0; i < detections.size(); i++) {
+			const int size = (i+1 < det_fill.size() ? det_fill[i+1] : pool_size) - det_fill[i];
+			detections[i].SetPixels(pixel_pool, det_fill[i], size);
+		}
+		for (int b = 0; b < num_bands; b++) {
+			const BandComponents& band = band_comps[b];
+			for (int k = 0; k+1 < band.starts.size(); k++) {
+				const int index = det_index[comp_groups.GetGroup(comp_offsets[b]+k)];
+				if (index != -1) {
+					copy(band.pixels.begin()+band.starts[k],
+					     band.pixels.begin()+band.starts[k+1],
+					     pixel_pool->begin()+det_fill[index]);
+					det_fill[index] += band.starts[k+1]-band.starts[k];
 				}
-				detections.push_back(curseg);
-				curseg.pixels.reset(new vector<ImageRef>);
 			}
 		}
 	}
 
-	void CannyLineDetector::FitLines() {
-		//
-		// Fit lines to each component
-		//
-		INDENTED BOOST_FOREACH(LineDetection& det, detections) {
+	void CannyLineDetector::FitLineRange(int i0, int i1) {
+		for (int i = i0; i <= i1; i++) {
+			LineDetection& det = detections[i];
+
+			// Components are disjoint so each thread writes distinct pixels
+			BOOST_FOREACH(const ImageRef& p, det.pixels()) {
+				segment_map[p.y][p.x] = i;
+			}
+
 			// Compute centroids
 			Vec2 mean = Zeros;
-			BOOST_FOREACH(const ImageRef& p, *det.pixels) {
+			BOOST_FOREACH(const ImageRef& p, det.pixels()) {
 				mean[0] += p.x;
 				mean[1] += p.y;
 			}
-			mean /= det.pixels->size();
+			mean /= det.num_pixels;
 
 			// Compute sums of normalized coords
 			float sum_xx = 0, sum_xy = 0, sum_yy = 0;
-			BOOST_FOREACH(const ImageRef& p, *det.pixels) {
+			BOOST_FOREACH(const ImageRef& p, det.pixels()) {
 				const float x = p.x - mean[0];
 				const float y = p.y - mean[1];
 				sum_xx += x*x;
@@ -163,7 +305,7 @@ namespace indoor_context {
 
 			// Determine line endpoints
 			double projmin = INFINITY, projmax = -INFINITY;
-			BOOST_FOREACH(const ImageRef& p, *det.pixels) {
+			BOOST_FOREACH(const ImageRef& p, det.pixels()) {
 				const Vec2 cur = makeVector(p.x, p.y);
 				const double proj = (cur-mean) * direction;
 				if (proj < projmin) {
@@ -181,6 +323,13 @@ namespace indoor_context {
 		}
 	}
 
+	void CannyLineDetector::FitLines() {
+		// Fit lines to each component
+		if (detections.empty()) return;
+		ParallelPartition(detections.size(), NumThreadsFor(detections.size()),
+		                  bind(&CannyLineDetector::FitLineRange, this, _1, _2));
+	}
+
 	void CannyLineDetector::Draw(ImageRGB<byte>& canvas) const {
 		Draw(canvas, VecI(0));
 	}
@@ -2,9 +2,12 @@
 
 #include <queue>
 
+#include <boost/range/iterator_range.hpp>
+
 #include "image_bundle.h"
 #include "common_types.h"
 #include "canny.h"
+#include "union_find.h"
 #include "line_segment.h"
 
 namespace indoor_context {
@@ -12,22 +15,41 @@ namespace indoor_context {
 	// Output operator for line segments
 	//ostream& operator<< (ostream& s, const LineSeg& seg);
 
+	// A pool of pixels shared by all the line detections from one
+	// invokation of a detector
+	typedef vector<ImageRef> PixelPool;
+
 	class LineDetection {
 	public:
 		LineDetection()
 			: eqn(toon::Zeros),
 				axis(-1),
-				pixels(new vector<ImageRef>) { }
+				pixel_offset(0),
+				num_pixels(0) { }
 		LineDetection(const Vec3& a, const Vec3& b, int ax=-1)
 			: seg(a,b),
 				eqn(a^b),
 				axis(ax),
-				pixels(new vector<ImageRef>) {
+				pixel_offset(0),
+				num_pixels(0) {
 		}
 		LineSeg seg;
 		Vec3 eqn;
 		int axis;
-		shared_ptr<vector<ImageRef> > pixels;
+
+		// The pixels that make up this detection are the interval
+		// [pixel_offset, pixel_offset+num_pixels) within pixel_pool
+		shared_ptr<const PixelPool> pixel_pool;
+		int pixel_offset;
+		int num_pixels;
+
+		// Get the pixels that make up this detection
+		inline boost::iterator_range<const ImageRef*> pixels() const {
+			const ImageRef* begin = num_pixels ? &(*pixel_pool)[pixel_offset] : NULL;
+			return boost::iterator_range<const ImageRef*>(begin, begin+num_pixels);
+		}
+		// Point this detection at an interval within a pool
+		void SetPixels(const shared_ptr<const PixelPool>& pool, int offset, int n);
 
 		void DrawPixels(ImageRGB<byte>& canvas,
 										const PixelRGB<byte>& color,
@@ -35,6 +57,12 @@ namespace indoor_context {
 										int thickness=1) const;
 	};
 
+	// Prepare an empty pool for a new invokation of a detector. The
+	// existing pool is cleared and re-used unless detections from a
+	// previous invokation still refer to it, in which case a new pool is
+	// allocated and those detections keep the old one.
+	void ResetPixelPool(shared_ptr<PixelPool>& pool);
+
 	// Finds line segments using the algorithm of (Kosecka and Zhang, 2002)
 	class CannyLineDetector {
 	public:
@@ -48,6 +76,9 @@ namespace indoor_context {
 		// The canny edge detector. Included here to allow it to re-use its
 		// buffers across several invokations.
 		Canny canny;
+		// Number of threads for each stage, or 0 for the defaults. The
+		// output does not depend on this.
+		int num_threads;
 
 		// Initializes the line detector empty
 		CannyLineDetector();
@@ -74,8 +105,33 @@ namespace indoor_context {
 		// Fit lines to each of the current connected components
 		void FitLines();
 
+		// Components are found within horizontal bands in parallel and
+		// then merged across band borders. Find components in bands
+		// within the interval [b0,b1].
+		void FindComponentBands(int b0, int b1);
+		// Fit lines to detections in the interval [i0,i1]
+		void FitLineRange(int i0, int i1);
+		// Get the number of threads to use for N jobs
+		int NumThreadsFor(int n) const;
+		// Get the first row in band b
+		inline int BandStart(int b) const {
+			return b * component_map.Rows() / band_comps.size();
+		}
+
+		// The components found within one band
+		struct BandComponents {
+			vector<ImageRef> pixels;  // pixels of all components, in BFS order
+			vector<int> starts;  // index of the first pixel of each component
+			vector<int> dirs;  // orientation bin of the seed of each component
+			int edge_begin, edge_end;  // interval of canny.edge_list in this band
+		};
+
 		// Internal buffers included here only to allow memory re-use
-		MatI seen;
-		queue<ImageRef> comp_queue;
+		shared_ptr<PixelPool> pixel_pool;  // pixels for all detections
+		MatI component_map;  // band-local component index, or -1
+		MatI ringdist;  // distance between orientation bins
+		vector<BandComponents> band_comps;
+		vector<int> comp_offsets;  // global index of the first component in each band
+		UnionFind comp_groups;  // forest over global component indices
 	};
 }
@@ -1,28 +1,239 @@
 #include "line_detector_bank.h"
 
+#include <fstream>
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
+
 #include "common_types.h"
 #include "vanishing_point_model.h"
 #include "line_detector.h"
 #include "map.h"
+#include "worker.h"
+#include "timer.h"
 
 #include "range_utils.tpp"
 
 namespace indoor_context {
+	using namespace toon;
+	using boost::bind;
+	using boost::cref;
+
+	// Identifies line detection side files. Increment the version
+	// whenever the file format or the line detector changes.
+	static const int kSideFileMagic = 0x4c444231;  // "LDB1"
+	static const int kSideFileVersion = 2;
+
+	// Every gvar that affects the output of CannyLineDetector
+	static const char* kDetectorVars[] = {
+		"Gradients.SmoothingSigma",
+		"Canny.ThreshLow",
+		"Canny.ThreshHigh",
+		"Canny.NumOrientBins",
+		"LineDetector.MinCompSize",
+		"LineDetector.MinCompSizePixels",
+		"LineDetector.NumOrientBins",
+		"LineDetector.OrientTol",
+		"LineDetector.NumBands"
+	};
+
+	// This is the 64-bit FNV-1a hash, which is stable across runs and
+	// platforms, unlike boost::hash.
+	static const unsigned long long kFnvOffset = 14695981039346656037ULL;
+	static void HashBytes(const void* data, int nbytes, unsigned long long& hash) {
+		const byte* bytes = reinterpret_cast<const byte*>(data);
+		for (int i = 0; i < nbytes; i++) {
+			hash ^= bytes[i];
+			hash *= 1099511628211ULL;
+		}
+	}
+
+	template <typename T>
+	void WriteBinary(ostream& s, const T& x) {
+		s.write(reinterpret_cast<const char*>(&x), sizeof(T));
+	}
+
+	template <typename T>
+	bool ReadBinary(istream& s, T& x) {
+		return !s.read(reinterpret_cast<char*>(&x), sizeof(T)).fail();
+	}
 
 	void LineDetectorBank::Configure(const Map& map) {
 		map_ = &map;
 		detection_sets.resize(map.frames.size());
+		processed.assign(map.frames.size(), 0);
 	}
 
 	void LineDetectorBank::ProcessFrame(int frame_id) {
 		CHECK(!detection_sets.empty())
 			<< "Must call LineDetectorBank::Configure() before Compute()";
 		CHECK_INDEX(frame_id, detection_sets);
-		if (detection_sets[frame_id].empty()) {
+		if (!processed[frame_id]) {
 			const Frame& frame = *map_->GetFrameById(frame_id);
 			CHECK(frame.image.loaded()) << "Image must be loaded by caller";
 			line_detector.Compute(frame.image);
 			copy_all_into(line_detector.detections, detection_sets[frame_id]);
+			processed[frame_id] = 1;
+		}
+	}
+
+	void LineDetectorBank::ProcessAllFrames() {
+		ProcessAllFrames(Worker::DefaultNumThreads());
+	}
+
+	void LineDetectorBank::ProcessAllFrames(int num_threads) {
+		CHECK(!detection_sets.empty())
+			<< "Must call LineDetectorBank::Configure() before ProcessAllFrames()";
+		vector<int> frame_ids;
+		BOOST_FOREACH(const Frame& frame, map_->frames) {
+			CHECK_INDEX(frame.id, detection_sets);
+			if (!processed[frame.id]) {
+				CHECK(frame.image.loaded()) << "Image must be loaded by caller";
+				frame_ids.push_back(frame.id);
+			}
+		}
+		if (frame_ids.empty()) return;
+
+		DLOG << "Detecting lines in " << frame_ids.size() << " frames";
+		TIMED("Parallel line detection")
+		ParallelPartition(frame_ids.size(),
+											min<int>(frame_ids.size(), max(num_threads, 1)),
+											bind(&LineDetectorBank::ProcessFrameRange,
+													 this, cref(frame_ids), _1, _2));
+	}
+
+	void LineDetectorBank::ProcessFrameRange(const vector<int>& frame_ids,
+																					 int i0, int i1) {
+		// Each thread gets its own detector since detectors keep state
+		// between invokations. Frames are already processed in parallel
+		// so each detector runs on this thread only.
+		CannyLineDetector detector;
+		detector.num_threads = 1;
+		for (int i = i0; i <= i1; i++) {
+			int id = frame_ids[i];
+			detector.Compute(map_->GetFrameByIdOrDie(id)->image);
+			copy_all_into(detector.detections, detection_sets[id]);
+			processed[id] = 1;
+		}
+	}
+
+	unsigned long long LineDetectorBank::ComputeFrameKey(int frame_id) const {
+		unsigned long long hash = kFnvOffset;
+		HashBytes(&kSideFileVersion, sizeof(int), hash);
+		for (int i = 0; i < sizeof(kDetectorVars)/sizeof(kDetectorVars[0]); i++) {
+			string value = GV3::get_var(kDetectorVars[i]);
+			int len = value.size();  // so that ("ab","c") != ("a","bc")
+			HashBytes(&len, sizeof(len), hash);
+			HashBytes(value.data(), len, hash);
+		}
+
+		// Hash the encoded image file rather than the pixels so that the
+		// image need not be loaded
+		const Frame& frame = *map_->GetFrameByIdOrDie(frame_id);
+		if (!frame.image_file.empty() && fs::exists(frame.image_file)) {
+			ifstream s(frame.image_file.c_str(), ios::binary);
+			char buf[65536];
+			while (s.read(buf, sizeof(buf)) || s.gcount() > 0) {
+				HashBytes(buf, s.gcount(), hash);
+			}
+		} else {
+			CHECK(frame.image.loaded())
+				<< "Frame " << frame_id << " has neither an image file nor a loaded image";
+			const ImageRGB<byte>& rgb = frame.image.rgb;
+			for (int y = 0; y < rgb.GetHeight(); y++) {
+				HashBytes(rgb[y], rgb.GetWidth()*sizeof(PixelRGB<byte>), hash);
+			}
+		}
+		return hash;
+	}
+
+	int LineDetectorBank::Load(const string& path) {
+		CHECK(!detection_sets.empty())
+			<< "Must call LineDetectorBank::Configure() before Load()";
+		ifstream s(path.c_str(), ios::binary);
+		if (!s) return 0;
+
+		int magic, version, num_frames;
+		if (!ReadBinary(s, magic) || magic != kSideFileMagic ||
+				!ReadBinary(s, version) || version != kSideFileVersion ||
+				!ReadBinary(s, num_frames)) {
+			DLOG << "Ignoring invalid line detection file: " << path;
+			return 0;
+		}
+
+		int num_loaded = 0;
+		for (int i = 0; i < num_frames; i++) {
+			int id, num_dets;
+			unsigned long long key;
+			CHECK(ReadBinary(s, id) && ReadBinary(s, key) && ReadBinary(s, num_dets))
+				<< "Truncated line detection file: " << path;
+			bool valid = id >= 0 && id < detection_sets.size() &&
+				map_->GetFrameById(id) != NULL && key == ComputeFrameKey(id);
+			if (valid) {
+				detection_sets[id].clear();
+				detection_sets[id].reserve(num_dets);
+			}
+			for (int j = 0; j < num_dets; j++) {
+				double data[6];
+				int axis;
+				CHECK(ReadBinary(s, data) && ReadBinary(s, axis))
+					<< "Truncated line detection file: " << path;
+				if (valid) {
+					LineDetection det(makeVector(data[0], data[1], data[2]),
+														makeVector(data[3], data[4], data[5]),
+														axis);
+					det.eqn = unit(det.eqn);  // as in CannyLineDetector
+					detection_sets[id].push_back(det);
+				}
+			}
+			if (valid) {
+				processed[id] = 1;
+				num_loaded++;
+			}
+		}
+		return num_loaded;
+	}
+
+	void LineDetectorBank::Save(const string& path) const {
+		vector<int> frame_ids;
+		for (int id = 0; id < processed.size(); id++) {
+			if (processed[id] && map_->GetFrameById(id) != NULL) {
+				frame_ids.push_back(id);
+			}
+		}
+
+		// Write to a temporary file and then rename so that concurrent
+		// processes never see a partial file.
+		string tmp_path = path + "." + boost::lexical_cast<string>(getpid()) + ".tmp";
+		ofstream s(tmp_path.c_str(), ios::binary);
+		CHECK(s) << "Could not open " << tmp_path << " for writing";
+		WriteBinary(s, kSideFileMagic);
+		WriteBinary(s, kSideFileVersion);
+		WriteBinary(s, static_cast<int>(frame_ids.size()));
+		BOOST_FOREACH(int id, frame_ids) {
+			const vector<LineDetection>& dets = detection_sets[id];
+			WriteBinary(s, id);
+			WriteBinary(s, ComputeFrameKey(id));
+			WriteBinary(s, static_cast<int>(dets.size()));
+			BOOST_FOREACH(const LineDetection& det, dets) {
+				double data[] = { det.seg.start[0], det.seg.start[1], det.seg.start[2],
+													det.seg.end[0], det.seg.end[1], det.seg.end[2] };
+				WriteBinary(s, data);
+				WriteBinary(s, det.axis);
+			}
+		}
+		s.close();
+		CHECK(s) << "Error writing " << tmp_path;
+		fs::rename(tmp_path, path);
+	}
+
+	void LineDetectorBank::LoadOrProcessAllFrames(const string& path) {
+		int num_loaded = Load(path);
+		DLOG << "Loaded line detections for " << num_loaded << " of "
+				 << map_->frames.size() << " frames from " << path;
+		if (num_loaded < map_->frames.size()) {
+			ProcessAllFrames();
+			Save(path);
 		}
 	}
 
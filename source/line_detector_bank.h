@@ -28,6 +28,23 @@ namespace indoor_context {
 
 		// Detect lines in a frame
 		void ProcessFrame(int frame_id);
+		// Detect lines in all frames that have not yet been processed, in
+		// parallel with one detector per thread. Images must be loaded by
+		// the caller.
+		void ProcessAllFrames();
+		void ProcessAllFrames(int num_threads);
+
+		// Read detections from a side file written by Save(). Frames whose
+		// image or detector parameters have changed since the file was
+		// written are skipped. Returns the number of frames loaded.
+		int Load(const string& path);
+		// Write the detections for all processed frames to a side file.
+		// Pixels are not stored, so loaded detections have no pixels.
+		void Save(const string& path) const;
+		// Load whatever is valid in the side file, detect lines in the
+		// remaining frames in parallel, and update the side file if
+		// anything was computed.
+		void LoadOrProcessAllFrames(const string& path);
 
 		// Compute rotation from all line detections in all frames
 		void GetDetectionsFor(int frame_id,
@@ -36,5 +53,12 @@ namespace indoor_context {
 													vector<LineSegment>& segments);
 		void GetObservationsFor(int frame_id,
 														vector<LineObservation>& observations);
+	private:
+		// Non-zero for each frame that has been processed or loaded
+		vector<char> processed;
+		// Detect lines in frames frame_ids[i0..i1] (inclusive)
+		void ProcessFrameRange(const vector<int>& frame_ids, int i0, int i1);
+		// Hash the image and detector parameters for a frame
+		unsigned long long ComputeFrameKey(int frame_id) const;
 	};
 }
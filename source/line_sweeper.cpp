@@ -1,8 +1,10 @@
+#include <boost/bind.hpp>
 #include <boost/ptr_container/ptr_vector.hpp>
 
 #include "line_sweeper.h"
 #include "common_types.h"
 #include "guided_line_detector.h"
+#include "worker.h"
 
 #include "vw_image.tpp"
 #include "image_utils.tpp"
@@ -11,10 +13,11 @@
 
 namespace indoor_context {
 using namespace toon;
+using boost::bind;
 
 lazyvar<int> gvBlockMarginSqr("LineSweeper.BlockMarginSqr");
 
-LineSweeper::LineSweeper() : input(NULL) {
+LineSweeper::LineSweeper() : input(NULL), lines(NULL) {
 }
 
 LineSweeper::LineSweeper(const PosedImage& image,
@@ -25,6 +28,24 @@ LineSweeper::LineSweeper(const PosedImage& image,
 void LineSweeper::Compute(const PosedImage& image,
                           const vector<LineDetection> lines[]) {
 	input = &image;
+	this->lines = lines;
+	for (int i = 0; i < 3; i++) {
+		image_vpts[i] = image.pc().GetImageVpt(i);
+	}
+
+	ParallelPartition(3, 3, bind(&LineSweeper::ComputeAxes, this, _1, _2));
+
+	int total_nan_sweeps = nan_sweeps[0] + nan_sweeps[1] + nan_sweeps[2];
+	if (total_nan_sweeps > 0) {
+		DLOG << "Warning: Ignored " << total_nan_sweeps << " sweeps due to NaN coordinates during line sweep";
+	}
+}
+
+void LineSweeper::ComputeAxes(int i0, int i1) {
+	const PosedImage& image = *input;
+	const int nx = image.nx();
+	const int ny = image.ny();
+	const Vec2I imsize = makeVector(nx, ny);
 
 	// Get bounding lines for the image
 	Bounds2D<double> image_bounds = Bounds2D<double>::FromSize(image.size());
@@ -35,18 +56,19 @@ void LineSweeper::Compute(const PosedImage& image,
 	bounding_lines.push_back(image_bounds.bottom_eqn());      // bottom
 
 	// Build support maps for each direction
-	int nan_sweeps = 0;
 	vector<Vec3 > blocks;
 	blocks.reserve(lines[0].size() + lines[1].size() + lines[2].size()); // upper bound
-	for (int i = 0; i < 3; i++) {
-		support_maps[i].Resize(image.ny(), image.nx());
-		support_maps[i].Fill(0);
-		num_pixels[i] = 0;
+	vector<pair<int, int> > scanlines;
+	for (int i = i0; i <= i1; i++) {
+		MatI& deltas = span_deltas[i];
+		deltas.Resize(ny, nx+1);
+		deltas.Fill(0);
+		nan_sweeps[i] = 0;
 
 		for (int j = 0; j < 3; j++) {
 			if (i == j) continue;
-			const Vec3 pivot = image.pc().GetImageVpt(i);
-			const Vec3 dir = image.pc().GetImageVpt(j);
+			const Vec3& pivot = image_vpts[i];
+			const Vec3& dir = image_vpts[j];
 
 			// TODO: Set these to projection with image bounds:
 			BOOST_FOREACH(const LineDetection& det, lines[i]) {
@@ -137,21 +159,38 @@ void LineSweeper::Compute(const PosedImage& image,
 				BOOST_FOREACH(const Vec3 v, poly) {
 					if (isnan(v)) {
 						found_nan = true;
-						nan_sweeps++;
+						nan_sweeps[i]++;
 						break;
 					}
 				}
 
-				// Mark the area
+				// Mark the area as a set of scanline spans
 				if (!found_nan) {
-					FillPolygon(poly, support_maps[i], 1);
+					int y0;
+					scanlines.clear();
+					ComputeFillScanlines(poly, imsize, y0, scanlines);
+					for (int k = 0; k < scanlines.size(); k++) {
+						int* deltarow = deltas[y0+k];
+						deltarow[scanlines[k].first]++;
+						deltarow[scanlines[k].second+1]--;
+					}
 				}
 			}
 		}
-	}
 
-	if (nan_sweeps > 0) {
-		DLOG << "Warning: Ignored " << nan_sweeps << " sweeps due to NaN coordinates during line sweep";
+		// Resolve the spans into the support map
+		support_maps[i].Resize(ny, nx);
+		num_pixels[i] = 0;
+		for (int y = 0; y < ny; y++) {
+			const int* deltarow = deltas[y];
+			int* suprow = support_maps[i][y];
+			int cover = 0;
+			for (int x = 0; x < nx; x++) {
+				cover += deltarow[x];
+				suprow[x] = cover > 0 ? 1 : 0;
+				num_pixels[i] += suprow[x];
+			}
+		}
 	}
 }
 
@@ -208,32 +247,20 @@ void IsctGeomLabeller::Compute(const PosedImage& image,
 	// Compute line sweeps
 	sweeper.Compute(image, lines);
 
-	// Produce final label maps
-	for (int i = 0; i < 3; i++) {
-		int sumi = 0;
-		for (int y = 0; y < image.ny(); y++) {
-			const int* suprow = sweeper.support_maps[i][y];
-			int* orientrow = orient_map[y];
-			for (int x = 0; x < image.nx(); x++) {
-				orientrow[x] |= suprow[x]<<i;
-			}
-		}
-	}
-
+	// Produce final label maps. The lookup table maps the bitmask of
+	// support from each axis to a label as follows:
+	//   011 -> 2
+	//   101 -> 1
+	//   110 -> 0
+	// these choices are important as they agree with LeeRecovery conventions
+	static const int kLabels[8] = { -1, -1, -1, 2, -1, 1, 0, -1 };
 	for (int y = 0; y < image.ny(); y++) {
+		const int* suprow0 = sweeper.support_maps[0][y];
+		const int* suprow1 = sweeper.support_maps[1][y];
+		const int* suprow2 = sweeper.support_maps[2][y];
 		int* orientrow = orient_map[y];
 		for (int x = 0; x < image.nx(); x++) {
-			// the numbers below are chosen to map:
-			//   011 -> 2
-			//   101 -> 1
-			//   110 -> 0
-			// these choices are important as they agree with LeeRecovery conventions
-			switch (orientrow[x]) {
-			case 3: orientrow[x] = 2; break;
-			case 5: orientrow[x] = 1; break;
-			case 6: orientrow[x] = 0; break;
-			default: orientrow[x] = -1; break;
-			}
+			orientrow[x] = kLabels[suprow0[x] | (suprow1[x]<<1) | (suprow2[x]<<2)];
 		}
 	}
 }
@@ -26,6 +26,21 @@ public:
 	             const vector<LineDetection> lines[3]);
 	// Produce a set of support vizualizations
 	void OutputSupportViz(const string& basename) const;
+private:
+	// Sweep the lines for axes in the interval [i0,i1]. The axes are
+	// independent so they are swept in parallel.
+	void ComputeAxes(int i0, int i1);
+
+	// Lines passed to Compute()
+	const vector<LineDetection>* lines;
+	// Vanishing points in image coordinates, computed once up front
+	// because the camera is not thread-safe
+	Vec3 image_vpts[3];
+	// Scanline spans are accumulated as +1 at the start and -1 after
+	// the end of each span, then resolved with one pass over each row
+	MatI span_deltas[3];
+	// Number of sweeps ignored due to NaN coordinates, for each axis
+	int nan_sweeps[3];
 };
 
 
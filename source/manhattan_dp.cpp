@@ -400,6 +400,40 @@ using namespace toon;
 		return BackProject(GridToImage(grid_point));
 	}
 
+	////////////////////////////////////////////////////////////////////////////////
+	bool DPWallExtents::Matches(const DPGeometry& geom) const {
+		if (ceil_ys.Rows() != geom.ny() ||
+				ceil_ys.Cols() != geom.nx() ||
+				horizon_row != geom.horizon_row) {
+			return false;
+		}
+		for (int i = 0; i < 3; i++) {
+			for (int j = 0; j < 3; j++) {
+				if (grid_floorToCeil[i][j] != geom.grid_floorToCeil[i][j]) {
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+
+	void DPWallExtents::Compute(const DPGeometry& geom) {
+		if (Matches(geom)) return;
+
+		ceil_ys.Resize(geom.ny(), geom.nx());
+		floor_ys.Resize(geom.ny(), geom.nx());
+		for (int y = 0; y < geom.ny(); y++) {
+			int* ceil_row = ceil_ys[y];
+			int* floor_row = floor_ys[y];
+			for (int x = 0; x < geom.nx(); x++) {
+				geom.GetWallExtent(makeVector(x,y), ceil_row[x], floor_row[x]);
+			}
+		}
+
+		grid_floorToCeil = geom.grid_floorToCeil;
+		horizon_row = geom.horizon_row;
+	}
+
 	////////////////////////////////////////////////////////////////////////////////
 	ManhattanDP::ManhattanDP() : geom(NULL) {
 		jump_thresh = *gvLineJumpThreshold;
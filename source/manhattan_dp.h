@@ -197,6 +197,29 @@ namespace indoor_context {
 		Vec3 BackProjectFromGrid(const Vec2& grid_point) const;
 	};
 
+	////////////////////////////////////////////////////////////////////////////////
+	// Represents the wall extents for every integer point in the grid,
+	// so that GetWallExtent() need not be called repeatedly for
+	// each feature computed for the same geometry. Each entry is
+	// identical to the output of DPGeometry::GetWallExtent.
+	class DPWallExtents {
+	public:
+		MatI ceil_ys, floor_ys;
+		// The geometry for which the table was last computed
+		Mat3 grid_floorToCeil;
+		int horizon_row;
+
+		// Initialize empty
+		DPWallExtents() : horizon_row(-1) { }
+		// Compute the table. Does nothing if the table is already
+		// up-to-date for this geometry.
+		void Compute(const DPGeometry& geom);
+		// Return true iff the table was computed for this geometry
+		bool Matches(const DPGeometry& geom) const;
+		// Return true iff not yet computed
+		bool Empty() const { return ceil_ys.Rows() == 0; }
+	};
+
 
 
 	////////////////////////////////////////////////////////////////////////////////
@@ -26,6 +26,7 @@ namespace indoor_context {
 
 	lazyvar<string> gvSequencesDir("Sequences.DataDir");
 	lazyvar<string> gvMapPath("Sequences.MapPath");
+	lazyvar<string> gvLineDetectionsPath("Sequences.LineDetectionsPath");
 
 	string GetMapPath(const string& sequence_name) {
 		fs::path file = fs::path(*gvSequencesDir) / sequence_name / *gvMapPath;
@@ -34,6 +35,11 @@ namespace indoor_context {
 		return file.string();
 	}
 
+	string GetLineDetectionsPath(const string& sequence_name) {
+		fs::path file = fs::path(*gvSequencesDir) / sequence_name / *gvLineDetectionsPath;
+		return file.string();
+	}
+
 	void LoadBundlerMap(const string& bundle_dir, Map& map) {
 		fs::path dir = fs::path(bundle_dir);
 		string bundle_file = (dir / "bundle/bundle.out").string();
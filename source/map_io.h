@@ -41,4 +41,7 @@ namespace indoor_context {
 	// Get the path to the truthed_map.pro file for a sequence, or die
 	// if the sequence is not found.
 	string GetMapPath(const string& sequence_name);
+	// Get the path to the line detection side file for a sequence. The
+	// file need not exist.
+	string GetLineDetectionsPath(const string& sequence_name);
 }
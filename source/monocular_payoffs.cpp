@@ -24,23 +24,30 @@ namespace indoor_context {
 			integ_feature.Compute(feature);
 		}
 
-		// Compute payoffs
-		for (int i = 0; i < 2; i++) {
-			vpayoffs[i].Resize(geom.grid_size);
-			for (int y = 0; y < geom.grid_size[1]; y++) {
-				float* outrow = vpayoffs[i].wall_scores[i][y];
-				for (int x = 0; x < geom.grid_size[0]; x++) {
-					outrow[x] = GetVertSum(x,y);
-				}
-			}
-		}
-
+		// Compute wall extents (no-op if the geometry has not changed)
+		wall_extents.Compute(geom);
+
+		// Compute payoffs. Each row of the output corresponds to one
+		// lookup per column in the integral image.
+		int nx = geom.grid_size[0];
+		int ny = geom.grid_size[1];
+		const MatF& integ = integ_feature.m_int;
+		vpayoffs[0].Resize(geom.grid_size);
+		vpayoffs[1].Resize(geom.grid_size);
 		hpayoffs.Resize(geom.grid_size);
-		for (int y = 0; y < geom.grid_size[1]; y++) {
-			float* outrow0 = hpayoffs.wall_scores[0][y];
-			float* outrow1 = hpayoffs.wall_scores[1][y];
-			for (int x = 0; x < geom.grid_size[0]; x++) {
-				outrow0[x] = outrow1[x] = GetHorizSum(x,y);
+		for (int y = 0; y < ny; y++) {
+			const int* y0s = wall_extents.ceil_ys[y];
+			const int* y1s = wall_extents.floor_ys[y];
+			float* voutrow0 = vpayoffs[0].wall_scores[0][y];
+			float* voutrow1 = vpayoffs[1].wall_scores[1][y];
+			float* houtrow0 = hpayoffs.wall_scores[0][y];
+			float* houtrow1 = hpayoffs.wall_scores[1][y];
+			for (int x = 0; x < nx; x++) {
+				float top = integ[y0s[x]][x];  // sum over rows 0..y0-1
+				float bottom = integ[y1s[x]+1][x];  // sum over rows 0..y1
+				float all = integ[ny][x];
+				voutrow0[x] = voutrow1[x] = bottom - top;
+				houtrow0[x] = houtrow1[x] = top + (all - bottom);
 			}
 		}
 	}
@@ -52,18 +59,20 @@ namespace indoor_context {
 	double FeaturePayoffGen::GetVertSum(int x, int y) const {
 		CHECK_GT(integ_feature.nx(), 0);
 		CHECK_INTERVAL(x, 0, geom.grid_size[0]-1);
+		CHECK_INTERVAL(y, 0, geom.grid_size[1]-1);
 
-		int y0, y1;
-		geom.GetWallExtent(makeVector(x,y), y0, y1);
+		int y0 = wall_extents.ceil_ys[y][x];
+		int y1 = wall_extents.floor_ys[y][x];
 		return integ_feature.Sum(x, y0, y1);
 	}
 
 	double FeaturePayoffGen::GetHorizSum(int x, int y) const {
 		CHECK_GT(integ_feature.nx(), 0);
 		CHECK_INTERVAL(x, 0, geom.grid_size[0]-1);
+		CHECK_INTERVAL(y, 0, geom.grid_size[1]-1);
 
-		int y0, y1;
-		geom.GetWallExtent(makeVector(x,y), y0, y1);
+		int y0 = wall_extents.ceil_ys[y][x];
+		int y1 = wall_extents.floor_ys[y][x];
 		return integ_feature.Sum(x, 0, y0-1)
 			+ integ_feature.Sum(x, y1+1, geom.grid_size[1]-1);
 	}
@@ -105,6 +114,9 @@ namespace indoor_context {
 				integ_scores[i].Compute(obj.pixel_scores[i]);
 			}
 		}
+
+		// Compute wall extents (no-op if the geometry has not changed)
+		wall_extents.Compute(geom);
 	}
 
 	bool ObjectivePayoffGen::Empty() const {
@@ -131,13 +143,31 @@ namespace indoor_context {
 			CHECK_EQ(matrix_size(integ_scores[i]), geom.grid_size+makeVector(0,1));
 		}
 
+		CHECK(wall_extents.Matches(geom))
+			<< "Configure() must be called before ComputePayoffs()";
+
+		// Each output element is a sum of three intervals within one
+		// column, which requires four lookups per integral image. The
+		// lookups are shared between the two wall orientations.
+		int nx = geom.grid_size[0];
+		int ny = geom.grid_size[1];
+		const MatF& vert = integ_scores[kVerticalAxis].m_int;
+		const MatF& wall0 = integ_scores[1].m_int;  // orient for axis 0
+		const MatF& wall1 = integ_scores[0].m_int;  // orient for axis 1
 		payoffs.Resize(geom.grid_size);
-		for (int i = 0; i < 2; i++) {
-			for (int y = 0; y < geom.grid_size[1]; y++) {
-				float* outrow = payoffs.wall_scores[i][y];
-				for (int x = 0; x < geom.grid_size[0]; x++) {
-					outrow[x] = GetWallScore(makeVector(x,y), i);
-				}
+		for (int y = 0; y < ny; y++) {
+			const int* y0s = wall_extents.ceil_ys[y];
+			const int* y1s = wall_extents.floor_ys[y];
+			float* outrow0 = payoffs.wall_scores[0][y];
+			float* outrow1 = payoffs.wall_scores[1][y];
+			for (int x = 0; x < nx; x++) {
+				int y0 = y0s[x];
+				int y1 = y1s[x]+1;
+				float top = vert[y0][x];
+				float bottom = vert[ny][x] - vert[y1][x];
+				// Keep the order of summation consistent with GetWallScore()
+				outrow0[x] = (top + (wall0[y1][x] - wall0[y0][x])) + bottom;
+				outrow1[x] = (top + (wall1[y1][x] - wall1[y0][x])) + bottom;
 			}
 		}
 		payoffs.wall_penalty = wall_penalty;
@@ -14,6 +14,7 @@ namespace indoor_context {
 	class FeaturePayoffGen {
 	public:
 		DPGeometry geom;
+		DPWallExtents wall_extents;  // re-used while the geometry is unchanged
 		IntegralColImage<float> integ_feature;
 		DPPayoffs vpayoffs[2];  // feature sums for vertical intervals
 		DPPayoffs hpayoffs;  // feature sums for floor/ceiling intervals
@@ -26,7 +27,7 @@ namespace indoor_context {
 		// Return true iff not yet configured
 		bool Empty() const;
 		// Get payoff for building a wall at a point in grid coordinates.
-		// grid_pt can be outside the grid bounds, clamping will be applied appropriately
+		// The point must be within the grid bounds.
 		double GetVertSum(int x, int y) const;
 		double GetHorizSum(int x, int y) const;
 	};
@@ -37,6 +38,7 @@ namespace indoor_context {
 	class ObjectivePayoffGen {
 	public:
 		DPGeometry geom;
+		DPWallExtents wall_extents;  // re-used while the geometry is unchanged
 		IntegralColImage<float> integ_scores[3];
 		double wall_penalty, occl_penalty;
 		DPPayoffs payoffs;  // payoffs are stored here when Compute() is called
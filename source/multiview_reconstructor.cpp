@@ -10,32 +10,92 @@
 #include "manhattan_dp.h"
 #include "canvas.h"
 #include "geom_utils.h"
+#include "worker.h"
 
 #include "vector_utils.tpp"
 
 namespace indoor_context {
 	using namespace toon;
 
+	// Default bound on the number of memoized payoff generators
+	static const int kDefaultMaxCachedGens = 16;
+
+	MultiViewPayoffs::MultiViewPayoffs()
+		: zfloor(0), zceil(0), cache_clock(0),
+			max_cached_gens(kDefaultMaxCachedGens) {
+	}
+
 	void MultiViewPayoffs::Configure(const DPGeometry& geom,
 																	 const DPObjective& obj,
 																	 double zf,
-																	 double zc) {
+																	 double zc,
+																	 int frame_id) {
+		// Memoized payoffs are only valid for a fixed floor and ceiling
+		if (zf != zfloor || zc != zceil) {
+			ClearCache();
+		}
 		base_geom = geom;
 		zfloor = zf;
 		zceil = zc;
-		base_payoff_gen.Configure(obj, base_geom);
-		base_payoff_gen.ComputePayoffs(base_payoffs); // for visualization only
+		base_payoff_gen = GetPayoffGen(base_geom, obj, frame_id);
 		aux_views.clear();
 	}
 
+	void MultiViewPayoffs::ClearCache() {
+		payoff_gen_cache.clear();
+	}
+
+	shared_ptr<ObjectivePayoffGen>
+	MultiViewPayoffs::GetPayoffGen(const DPGeometry& geom,
+																 const DPObjective& obj,
+																 int frame_id) {
+		if (frame_id >= 0) {
+			map<int, CachedPayoffGen>::iterator it = payoff_gen_cache.find(frame_id);
+			if (it != payoff_gen_cache.end()) {
+				CHECK(it->second.gen->wall_extents.Matches(geom))
+					<< "Frame " << frame_id << " was memoized with a different geometry";
+				it->second.last_use = cache_clock++;
+				return it->second.gen;
+			}
+		}
+
+		// Compute() also stores the payoffs, which are used for
+		// visualization and for the transfer in ComputeRows()
+		shared_ptr<ObjectivePayoffGen> gen(new ObjectivePayoffGen);
+		gen->Compute(obj, geom);
+		if (frame_id >= 0) {
+			CachedPayoffGen& entry = payoff_gen_cache[frame_id];
+			entry.gen = gen;
+			entry.last_use = cache_clock++;
+			TrimCache();
+		}
+		return gen;
+	}
+
+	void MultiViewPayoffs::TrimCache() {
+		// Views that are still in use hold their own reference, so
+		// evicting them only costs memory if they are requested again
+		while (static_cast<int>(payoff_gen_cache.size()) > max(max_cached_gens, 1)) {
+			map<int, CachedPayoffGen>::iterator oldest = payoff_gen_cache.begin();
+			for (map<int, CachedPayoffGen>::iterator it = payoff_gen_cache.begin();
+					 it != payoff_gen_cache.end();
+					 it++) {
+				if (it->second.last_use < oldest->second.last_use) {
+					oldest = it;
+				}
+			}
+			payoff_gen_cache.erase(oldest);
+		}
+	}
+
 	void MultiViewPayoffs::AddView(const DPGeometry& aux_geom,
-																 const DPObjective& obj) {
-		CHECK(!base_payoff_gen.Empty()) << "Configure() must be called before AddView()";
+																 const DPObjective& obj,
+																 int frame_id) {
+		CHECK(base_payoff_gen) << "Configure() must be called before AddView()";
 
 		AuxiliaryView* view = new AuxiliaryView;
 		view->geom = aux_geom;
-		view->payoff_gen.Configure(obj, aux_geom);
-		view->payoff_gen.ComputePayoffs(view->payoffs); // for visualization only
+		view->payoff_gen = GetPayoffGen(aux_geom, obj, frame_id);
 	
 		view->image_hfloor = GetHomographyVia(*base_geom.camera,
 																					*aux_geom.camera,
@@ -54,7 +114,7 @@ namespace indoor_context {
 	}
 
 	void MultiViewPayoffs::Compute() {
-		CHECK(!base_payoff_gen.Empty()) << "Configure() must be called before Compute()";
+		CHECK(base_payoff_gen) << "Configure() must be called before Compute()";
 
 		// Configure the payoff matrices
 		payoffs.Resize(base_geom.grid_size);
@@ -63,12 +123,20 @@ namespace indoor_context {
 			aux.contrib_payoffs.Clear(-1);  // for visualization only
 		}
 
+		// Each row is independent so the results do not depend on the
+		// number of threads
+		ParallelPartition(base_geom.grid_size[1],
+											bind(&MultiViewPayoffs::ComputeRows, ref(*this), _1, _2));
+	}
+
+	void MultiViewPayoffs::ComputeRows(int r0, int r1) {
 		for (int orient = 0; orient < 2; orient++) {
-			for (int y = 0; y < base_geom.grid_size[1]; y++) {
+			const MatF& base_scores = base_payoff_gen->payoffs.wall_scores[orient];
+			for (int y = r0; y <= r1; y++) {
 				for (int x = 0; x < base_geom.grid_size[0]; x++) {
 					// initialize to payoffs in base view
 					Vec2I p = makeVector(x,y);
-					double sum_payoffs = base_payoff_gen.GetWallScore(p, orient);
+					double sum_payoffs = base_scores[y][x];
 					double sum_weights = 1.0;  // the base view gets weighted by 1.0
 
 					BOOST_FOREACH(AuxiliaryView& aux, aux_views) {
@@ -81,7 +149,14 @@ namespace indoor_context {
 						if (p_aux[0] >= 0 && p_aux[0] < aux.geom.grid_size[0]) {
 							// For now, the aux view contribute half weight w.r.t to base view
 							double weight = 0.5;
-							double payoff = aux.payoff_gen.GetWallScore(p_aux, orient);
+							// Use the precomputed payoffs where possible (they are
+							// identical to GetWallScore for in-bounds points)
+							double payoff;
+							if (p_aux[1] >= 0 && p_aux[1] < aux.geom.grid_size[1]) {
+								payoff = aux.payoff_gen->payoffs.wall_scores[orient][ p_aux[1] ][ p_aux[0] ];
+							} else {
+								payoff = aux.payoff_gen->GetWallScore(p_aux, orient);
+							}
 							sum_payoffs += weight * payoff;
 							sum_weights += weight;
 
@@ -149,7 +224,8 @@ namespace indoor_context {
 	void MultiViewReconstructor::Configure(const PosedImage& frame,
 																				 const DPObjective& obj,
 																				 double zf,
-																				 double zc) {
+																				 double zc,
+																				 int frame_id) {
 		base_frame = &frame;
 		base_objective = &obj;
 		zfloor = zf;
@@ -157,7 +233,7 @@ namespace indoor_context {
 
 		Mat3 fToC = GetManhattanHomology(frame.pc(), zfloor, zceil);
 		DPGeometry base_geom(frame.pc(), fToC);
-		joint_payoff_gen.Configure(base_geom, obj, zfloor, zceil);
+		joint_payoff_gen.Configure(base_geom, obj, zfloor, zceil, frame_id);
 		aux_frames.clear();
 		aux_objectives.clear();
 		aux_gen.clear();
@@ -171,13 +247,14 @@ namespace indoor_context {
 	}
 
 	void MultiViewReconstructor::AddFrame(const PosedImage& frame,
-																				const DPObjective& obj) {
+																				const DPObjective& obj,
+																				int frame_id) {
 		CHECK(base_frame) << "AddFrame() was called before Configure()";
 		aux_frames.push_back(&frame);
 		aux_objectives.push_back(&obj);
 		Mat3 fToC = GetManhattanHomology(frame.pc(), zfloor, zceil);
 		DPGeometry geom(frame.pc(), fToC);
-		joint_payoff_gen.AddView(geom, obj);
+		joint_payoff_gen.AddView(geom, obj, frame_id);
 	}
 
 	void MultiViewReconstructor::AddFrame(const PosedImage& frame) {
@@ -205,7 +282,7 @@ namespace indoor_context {
 	void MultiViewReconstructor::OutputBasePayoffs(const string& filename) {
 		OutputPayoffsViz(filename,
 										 base_frame->rgb,
-										 joint_payoff_gen.base_payoffs,
+										 joint_payoff_gen.base_payoff_gen->payoffs,
 										 joint_payoff_gen.base_geom);
 	}
 
@@ -219,7 +296,7 @@ namespace indoor_context {
 			DLOG << "Visualizing auxiliary frame " << i;
 			OutputPayoffsViz(str(format("%saux%02d_payoffs.png") % basename % i),
 											 aux_frames[i]->rgb,
-											 joint_payoff_gen.aux_views[i].payoffs,
+											 joint_payoff_gen.aux_views[i].payoff_gen->payoffs,
 											 joint_payoff_gen.aux_views[i].geom);
 			OutputPayoffsViz(str(format("%saux%02d_contrib.png") % basename % i),
 											 base_frame->rgb,
@@ -1,3 +1,5 @@
+#include <map>
+
 #include <boost/array.hpp>
 #include <boost/ptr_container/ptr_vector.hpp>
 
@@ -16,35 +18,75 @@ namespace indoor_context {
 			DPGeometry geom;  // DP geometry for base view
 			Mat3 grid_hfloor;  // homography from base view to this one, via floor plan, in grid coords
 			Mat3 grid_hceil;  // homography from base view to this one, via ceiling plan, in grid coords
-			ObjectivePayoffGen payoff_gen;
+			// Payoff generator for this view. Its payoffs member contains
+			// the monocular payoffs for this view. May be shared with
+			// other MultiViewPayoffs computations (see payoff_gen_cache).
+			shared_ptr<ObjectivePayoffGen> payoff_gen;
 
 			// These are only kept for analysis/visualization:
-			  DPPayoffs payoffs;  // Monocular payoffs for this view
 			  DPPayoffs contrib_payoffs;  // Payoffs transferred into base view
 			  Mat3 image_hfloor;  // only for debugging...
 			  Mat3 image_hceil;
 		};
 
 		double zfloor, zceil;
+		// Incremented on every memoized lookup, for LRU eviction
+		int cache_clock;
 
 		DPGeometry base_geom;  // DP geometry for base view
-		ObjectivePayoffGen base_payoff_gen;  // The payoff generator
-		DPPayoffs base_payoffs;  // Monocular payoffs for base view (only kept for visualization)
+		shared_ptr<ObjectivePayoffGen> base_payoff_gen;  // The payoff generator
 
 		boost::ptr_vector<AuxiliaryView> aux_views; // DP geometries for auxiliary views
 	
 		DPPayoffs payoffs;  // Node payoffs computed for all views jointly
-	
-		// Set up the base view
+
+		// A memoized payoff generator and when it was last used
+		struct CachedPayoffGen {
+			shared_ptr<ObjectivePayoffGen> gen;
+			int last_use;
+		};
+		// Payoff generators indexed by frame ID, so that a frame that is
+		// used as both a base view and an auxiliary view (or as an
+		// auxiliary view for several base views) is only processed
+		// once. Cleared when zfloor or zceil change.
+		map<int, CachedPayoffGen> payoff_gen_cache;
+		// Maximum number of generators in the above. The least recently
+		// used are evicted beyond this. When sliding a window of
+		// auxiliary views along a sequence, 2*num_aux_views+1 keeps
+		// every frame that is still in the window.
+		int max_cached_gens;
+
+		// Initialize empty
+		MultiViewPayoffs();
+		// Set up the base view. If frame_id is non-negative then the
+		// monocular payoffs for this view are memoized under that ID, in
+		// which case the caller must guarantee that the same ID always
+		// corresponds to the same objective and geometry.
 		void Configure(const DPGeometry& base_geom,
 									 const DPObjective& base_obj,
 									 double zfloor,
-									 double zceil);
-		// Add an auxiliary view
+									 double zceil,
+									 int frame_id=-1);
+		// Add an auxiliary view. See Configure() regarding frame_id.
 		void AddView(const DPGeometry& geom,
-								 const DPObjective& payoffs);
-		// Compute the joint payoffs
+								 const DPObjective& payoffs,
+								 int frame_id=-1);
+		// Compute the joint payoffs. Rows are processed in parallel.
 		void Compute();
+		// Compute the joint payoffs for rows r0..r1 inclusive (used
+		// internally by Compute())
+		void ComputeRows(int r0, int r1);
+		// Forget all memoized payoffs
+		void ClearCache();
+
+		// Get monocular payoffs for a view, memoized if frame_id >= 0
+		shared_ptr<ObjectivePayoffGen> GetPayoffGen(const DPGeometry& geom,
+																								const DPObjective& obj,
+																								int frame_id);
+
+		// Evict least recently used generators until at most
+		// max_cached_gens remain
+		void TrimCache();
 
 		// Output corresponding points between base and aux view
 		void OutputCorrespondences(const string& filename,
@@ -81,13 +123,18 @@ namespace indoor_context {
 		MultiViewReconstructor();
 		// Configure the reconstructor with a base frame (call this first)
 		void Configure(const PosedImage& base_frame, double zfloor, double zceil);
+		// If frame_id is non-negative then payoffs are memoized under
+		// that ID (see MultiViewPayoffs::Configure)
 		void Configure(const PosedImage& base_frame,
 									 const DPObjective& base_obj,
 									 double zfloor,
-									 double zceil);
+									 double zceil,
+									 int frame_id=-1);
 		// Add a frame (call this zero or more times between Configure() and Reconstruct())
 		void AddFrame(const PosedImage& aux_frame);
-		void AddFrame(const PosedImage& aux_frame, const DPObjective& aux_obj);
+		void AddFrame(const PosedImage& aux_frame,
+									const DPObjective& aux_obj,
+									int frame_id=-1);
 		// Compute payoffs for all frames and do the reconstructor (call this last)
 		void Reconstruct();
 		// Visualizations
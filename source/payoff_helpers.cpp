@@ -1,5 +1,11 @@
 #include "payoff_helpers.h"
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
+
 #include "common_types.h"
 #include "protobuf_utils.h"
 
@@ -97,6 +103,89 @@ namespace indoor_context {
 		UnpackFeatures(p, fset);
 	}
 
+	PayoffCacheKey::PayoffCacheKey() : hash(14695981039346656037ULL) {
+		Add(kCodeVersion);
+	}
+
+	void PayoffCacheKey::Add(const void* data, int nbytes) {
+		// This is the 64-bit FNV-1a hash, which is stable across runs
+		// and platforms, unlike boost::hash.
+		const byte* bytes = reinterpret_cast<const byte*>(data);
+		for (int i = 0; i < nbytes; i++) {
+			hash ^= bytes[i];
+			hash *= 1099511628211ULL;
+		}
+	}
+
+	void PayoffCacheKey::Add(const string& s) {
+		Add(static_cast<int>(s.size()));  // so that ("ab","c") != ("a","bc")
+		Add(s.data(), s.size());
+	}
+
+	void PayoffCacheKey::Add(int x) {
+		Add(&x, sizeof(x));
+	}
+
+	void PayoffCacheKey::Add(double x) {
+		Add(&x, sizeof(x));
+	}
+
+	void PayoffCacheKey::AddVar(const string& name) {
+		Add(name);
+		Add(GV3::get_var(name));
+	}
+
+	string PayoffCacheKey::ToString() const {
+		char buf[17];
+		sprintf(buf, "%016llx", hash);
+		return buf;
+	}
+
+	void PayoffCacheKey::FromString(const string& s) {
+		CHECK_EQ(s.size(), 16) << "Not a cache key: " << s;
+		hash = strtoull(s.c_str(), NULL, 16);
+	}
+
+	PayoffCache::PayoffCache(const string& dir) : cache_dir(dir) {
+		CHECK(fs::exists(dir)) << "Payoff cache dir does not exist: " << dir;
+	}
+
+	string PayoffCache::GetPathFor(const PayoffCacheKey& key) const {
+		string filename = key.ToString() + ".protodata";
+		return (fs::path(cache_dir) / filename).string();
+	}
+
+	bool PayoffCache::Contains(const PayoffCacheKey& key) const {
+		return fs::exists(GetPathFor(key));
+	}
+
+	bool PayoffCache::Load(const PayoffCacheKey& key,
+												 DPPayoffs& payoffs,
+												 string& description) const {
+		string path = GetPathFor(key);
+		if (!fs::exists(path)) {
+			return false;
+		}
+		proto::PayoffFeature data;
+		ReadLargeProto(path, data);
+		UnpackPayoffs(data, payoffs);
+		description = data.has_description() ? data.description() : "";
+		return true;
+	}
+
+	void PayoffCache::Store(const PayoffCacheKey& key,
+													const DPPayoffs& payoffs,
+													const string& description) const {
+		proto::PayoffFeature data;
+		PackPayoffs(payoffs, description, data);
+		// Write to a temporary file and then rename so that concurrent
+		// processes sharing the cache never see a partial entry.
+		string path = GetPathFor(key);
+		string tmp_path = path + "." + boost::lexical_cast<string>(getpid()) + ".tmp";
+		WriteProto(tmp_path, data);
+		fs::rename(tmp_path, path);
+	}
+
 	ManhattanHyperParameters::ManhattanHyperParameters(const VecF& w,
 																										 float c,
 																										 float o)
@@ -125,16 +214,32 @@ namespace indoor_context {
 
 	void PayoffFeatures::Compile(const ManhattanHyperParameters& params,
 															 DPPayoffs& payoffs) const {
+		CompileInternal(params, NULL, payoffs);
+	}
+
+	void PayoffFeatures::CompileWithLoss(const ManhattanHyperParameters& params,
+																			 const MatF& loss_terms,
+																			 DPPayoffs& payoffs) const {
+		CompileInternal(params, &loss_terms, payoffs);
+	}
+
+	void PayoffFeatures::CompileInternal(const ManhattanHyperParameters& params,
+																			 const MatF* loss_terms,
+																			 DPPayoffs& payoffs) const {
 		// Copy penalties
 		payoffs.wall_penalty = params.corner_penalty;
 		payoffs.occl_penalty = params.occlusion_penalty;
 
-		// Sum features
+		// Sum features in a single pass
 		CHECK(!features.empty());
 		CHECK_EQ(params.weights.Size(), features.size());
-		payoffs.Resize(matrix_size(features[0]));
-		for (int i = 0; i < params.weights.size(); i++) {
-			payoffs.Add(features[i], params.weights[i]);
+		vector<const DPPayoffs*> ftrs(features.size());
+		vector<double> weights(features.size());
+		for (int i = 0; i < features.size(); i++) {
+			ftrs[i] = &features[i];
+			weights[i] = params.weights[i];
 		}
+		payoffs.Resize(matrix_size(features[0]));
+		payoffs.AddWeighted(ftrs, weights, loss_terms);
 	}		
 }
@@ -32,6 +32,16 @@ namespace indoor_context {
 		// Compile a payoff function from features and weights
 		void Compile(const ManhattanHyperParameters& params,
 								 DPPayoffs& out_payoffs) const;
+		// Compile a payoff function from features and weights, then add
+		// loss terms to both orientations (for loss-augmented inference)
+		void CompileWithLoss(const ManhattanHyperParameters& params,
+												 const MatF& loss_terms,
+												 DPPayoffs& out_payoffs) const;
+		// Implementation of the above. If loss_terms is NULL then no loss
+		// terms are added.
+		void CompileInternal(const ManhattanHyperParameters& params,
+												 const MatF* loss_terms,
+												 DPPayoffs& out_payoffs) const;
 	};
 
 	// Represents performance statistics for a reconstruction algorithm.
@@ -77,4 +87,53 @@ namespace indoor_context {
 	void WriteFeatures(const string& path, const PayoffFeatures& fset);
 	// Read features from file
 	void ReadFeatures(const string& path, PayoffFeatures& fset);
+
+	// Represents a content hash identifying one cached payoff
+	// feature. Every input that affects the feature must be added
+	// to the key.
+	class PayoffCacheKey {
+	public:
+		// Incrementing this invalidates all existing cache entries. It
+		// must be incremented whenever the feature computations change.
+		static const int kCodeVersion = 2;
+
+		unsigned long long hash;
+
+		// Initialize with the code version
+		PayoffCacheKey();
+		// Add raw bytes to the hash
+		void Add(const void* data, int nbytes);
+		// Add values to the hash
+		void Add(const string& s);
+		void Add(int x);
+		void Add(double x);
+		// Add the current value of a gvar to the hash
+		void AddVar(const string& name);
+		// Get the hash as a hexadecimal string
+		string ToString() const;
+		// Set the hash from a string returned by ToString
+		void FromString(const string& s);
+	};
+
+	// Represents a directory of payoff features in which each feature
+	// is stored in its own file, named according to a PayoffCacheKey.
+	class PayoffCache {
+	public:
+		string cache_dir;
+
+		// Initialize with a directory, which must exist
+		PayoffCache(const string& dir);
+		// Get the file for a specific key
+		string GetPathFor(const PayoffCacheKey& key) const;
+		// Return true iff the cache contains the given key
+		bool Contains(const PayoffCacheKey& key) const;
+		// Load a feature. Returns false if the key is not in the cache.
+		bool Load(const PayoffCacheKey& key,
+							DPPayoffs& payoffs,
+							string& description) const;
+		// Store a feature, replacing any existing entry
+		void Store(const PayoffCacheKey& key,
+							 const DPPayoffs& payoffs,
+							 const string& description) const;
+	};
 }
@@ -290,8 +290,10 @@ int main(int argc, char **argv) {
 	SO3<> R_orig_gt = SO3<>::exp(asToon(gt_map.ln_scene_from_slam()));
 	map.LoadAllImages();
 
-	// Set up the line detection manager
+	// Set up the line detection manager and detect lines in all frames,
+	// or load them from a previous run
 	LineDetectorBank line_bank(map);
+	line_bank.LoadOrProcessAllFrames(GetLineDetectionsPath(sequence));
 
 	// Initialize the normal-based rotation estimator
 	NormalRotationEstimator normal_est(map.points);
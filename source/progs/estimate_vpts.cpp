@@ -55,6 +55,7 @@ int main(int argc, char **argv) {
 	map.LoadAllImages();
 
 	LineDetectorBank line_bank(map);
+	line_bank.LoadOrProcessAllFrames(GetLineDetectionsPath(sequence));
 
 	// Detect lines
 	vector<LineObservation> observations;
@@ -72,6 +72,7 @@ int main(int argc, char **argv) {
 	// Do the actual evaluation
 	format filepat("out/frame%03d_%s.png");
 	MultiViewReconstructor mv;
+	mv.joint_payoff_gen.max_cached_gens = 2*num_aux_views+1;
 	ManhattanDPReconstructor mono;
 	BOOST_FOREACH(int base_id, test_ids) {
 		TITLE(str(format("Reconstructing frame %d")%base_id));
@@ -79,7 +80,7 @@ int main(int argc, char **argv) {
 		// Add the base frame
 		Frame* base_frame = map.KeyFrameByIdOrDie(base_id);
 		base_frame->LoadImage();
-		mv.Configure(base_frame->image, objectives[base_id], zfloor, zceil);
+		mv.Configure(base_frame->image, objectives[base_id], zfloor, zceil, base_id);
 
 		// Add the auxiliary frames
 		vector<int> aux_ids;
@@ -90,7 +91,7 @@ int main(int argc, char **argv) {
 
 			Frame* frame = map.KeyFrameByIdOrDie(aux_id);
 			frame->LoadImage();
-			mv.AddFrame(frame->image, objectives[aux_id]);
+			mv.AddFrame(frame->image, objectives[aux_id], aux_id);
 			aux_ids.push_back(aux_id);
 		}
 		DLOG << "Using auxiliary frames: " << iowrap(aux_ids);
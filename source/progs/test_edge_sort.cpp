@@ -0,0 +1,91 @@
+#include "entrypoint_types.h"
+#include "fhsegmenter.h"
+#include "image_bundle.h"
+#include "timer.h"
+
+lazyvar<string> gvEdgeStrategy("FHSegmenter.EdgeStrategy");
+
+bool SameEdges(const vector<Edge>& a, const vector<Edge>& b, int n) {
+	for (int i = 0; i < n; i++) {
+		if (a[i].src != b[i].src ||
+				a[i].dest != b[i].dest ||
+				a[i].weight != b[i].weight) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Check that the radix sort matches stable_sort for any number of threads
+void CheckSameEdges(int w, int h) {
+	TITLE("Checking " << w << "x" << h << " image");
+
+	// Quantize the weights so that there are many ties, and give runs
+	// of pixels the same label so that some horizontal edges are skipped
+	MatF image(h, w);
+	MatI segmentation(h, w);
+	for (int y = 0; y < h; y++) {
+		for (int x = 0; x < w; x++) {
+			image[y][x] = rand() % 16;
+			segmentation[y][x] = y*w + x - (rand() % 3 == 0 && x > 0 ? 1 : 0);
+		}
+	}
+
+	const int capacity = 2 * (w-1) * (h-1);
+	vector<Edge> expected(capacity);
+	int n;
+	TIMED("Extract and stable_sort") {
+		n = capacity == 0 ? 0 : ExtractEdgeRows(image, segmentation, 0, h-2, &expected[0]);
+		stable_sort(expected.begin(), expected.begin()+n);
+	}
+
+	const int kNumThreads[] = { 1, 2, 3, 4, 7, 16 };
+	for (int i = 0; i < sizeof(kNumThreads)/sizeof(kNumThreads[0]); i++) {
+		vector<Edge> edges(capacity), buffer(capacity);
+		int m;
+		TIMED("Parallel radix sort")
+			m = ExtractSortedEdges(image, segmentation, kNumThreads[i], edges, buffer);
+		CHECK_EQ(m, n) << "Wrong number of edges with " << kNumThreads[i] << " threads";
+		CHECK(SameEdges(expected, edges, n))
+			<< "Edges differ from stable_sort with " << kNumThreads[i] << " threads";
+	}
+}
+
+// Check that segmentations with the radix strategy do not depend on the
+// number of threads
+void CheckSameSegmentation(const ImageBundle& image) {
+	*gvEdgeStrategy = "ParallelRadix";
+	FHSegmenter single;
+	single.num_threads = 1;
+	TIMED("Segment on one thread") single.Compute(image);
+	FHSegmenter multi;
+	multi.num_threads = 8;
+	TIMED("Segment on many threads") multi.Compute(image);
+	CHECK_EQ(single.num_segments, multi.num_segments);
+	for (int y = 0; y < image.ny(); y++) {
+		for (int x = 0; x < image.nx(); x++) {
+			CHECK_EQ(single.segmentation[y][x], multi.segmentation[y][x])
+				<< "Segmentations differ at " << x << "," << y;
+		}
+	}
+	DLOG << single.num_segments << " segments";
+}
+
+int main(int argc, char **argv) {
+	InitVars(argc, argv);
+
+	srand(0);
+	const int kSizes[][2] = { { 1, 1 }, { 2, 2 }, { 5, 3 }, { 97, 61 }, { 320, 240 }, { 641, 479 } };
+	for (int i = 0; i < sizeof(kSizes)/sizeof(kSizes[0]); i++) {
+		CheckSameEdges(kSizes[i][0], kSizes[i][1]);
+	}
+
+	// Optionally check a real image too
+	if (argc > 1) {
+		ImageBundle image(argv[1]);
+		TITLED("Image") CheckSameSegmentation(image);
+	}
+
+	DLOG << "Radix sorted edges match stable_sort";
+	return 0;
+}
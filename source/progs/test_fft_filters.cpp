@@ -0,0 +1,66 @@
+#include "entrypoint_types.h"
+#include "filters.h"
+#include "image_bundle.h"
+#include "timer.h"
+
+#include "image_utils.tpp"
+
+// Check that the frequency domain filter bank matches the spatial one
+void CheckSameResponses(const MatF& input, int nscales, int norients) {
+	TITLE("Checking " << input.Cols() << "x" << input.Rows() << " input with "
+				<< nscales << " scales and " << norients << " orientations");
+	GaborFilters sequential(nscales, norients);
+	GaborFilters fft(nscales, norients);
+
+	TIMED("Sequential") sequential.RunSequential(input);
+	TIMED("FFT (first run)") fft.RunFFT(input);
+	TIMED("FFT (second run)") fft.RunFFT(input);
+
+	CHECK_EQ(sequential.responses.size(), fft.responses.size());
+	for (int i = 0; i < sequential.responses.size(); i++) {
+		const MatF& a = *sequential.responses[i];
+		const MatF& b = *fft.responses[i];
+		CHECK_EQ(a.Rows(), b.Rows());
+		CHECK_EQ(a.Cols(), b.Cols());
+		double maxerr = 0, maxval = 0;
+		for (int y = 0; y < a.Rows(); y++) {
+			for (int x = 0; x < a.Cols(); x++) {
+				maxerr = max(maxerr, static_cast<double>(abs(a[y][x] - b[y][x])));
+				maxval = max(maxval, static_cast<double>(abs(a[y][x])));
+			}
+		}
+		DLOG << "Response " << i << ": max error " << maxerr << " (max value " << maxval << ")";
+		CHECK_LE(maxerr, 1e-4 * max(maxval, 1.0)) << "Response " << i << " differs";
+	}
+}
+
+int main(int argc, char **argv) {
+	InitVars(argc, argv);
+
+	// Random images with sizes that are not powers of two
+	srand(0);
+	const int kSizes[][2] = { { 97, 61 }, { 320, 240 }, { 641, 479 } };
+	for (int i = 0; i < 3; i++) {
+		MatF input(kSizes[i][1], kSizes[i][0]);
+		for (int y = 0; y < input.Rows(); y++) {
+			for (int x = 0; x < input.Cols(); x++) {
+				input[y][x] = 1.0f * rand() / RAND_MAX;
+			}
+		}
+		CheckSameResponses(input, 3, 4);
+	}
+	MatF odd(50, 70);
+	odd.Fill(0.5);
+	CheckSameResponses(odd, 2, 3);  // odd number of filters
+
+	// Optionally check a real image too
+	if (argc > 1) {
+		ImageBundle image(argv[1]);
+		MatF input;
+		ImageToMatrix(image, input);
+		CheckSameResponses(input, 3, 4);
+	}
+
+	DLOG << "All responses match";
+	return 0;
+}
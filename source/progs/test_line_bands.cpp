@@ -0,0 +1,82 @@
+#include "entrypoint_types.h"
+#include "line_detector.h"
+#include "image_bundle.h"
+#include "timer.h"
+
+lazyvar<int> gvNumBands("LineDetector.NumBands");
+
+bool SameVector(const Vec3& a, const Vec3& b) {
+	return a[0] == b[0] && a[1] == b[1] && a[2] == b[2];
+}
+
+bool SameDetections(const vector<LineDetection>& a, const vector<LineDetection>& b) {
+	if (a.size() != b.size()) return false;
+	for (int i = 0; i < a.size(); i++) {
+		if (!SameVector(a[i].seg.start, b[i].seg.start)) return false;
+		if (!SameVector(a[i].seg.end, b[i].seg.end)) return false;
+		if (a[i].num_pixels != b[i].num_pixels) return false;
+		if (!equal(a[i].pixels().begin(), a[i].pixels().end(), b[i].pixels().begin())) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Detect lines with the given number of bands and threads
+void Detect(const ImageBundle& image, int num_bands, int num_threads,
+            vector<LineDetection>& out) {
+	*gvNumBands = num_bands;
+	CannyLineDetector detector;
+	detector.num_threads = num_threads;
+	detector.Compute(image);
+	out = detector.detections;
+}
+
+// Check that detections do not depend on the number of threads, and
+// compare one band against several
+void CheckBands(const ImageBundle& image, bool expect_same_as_one_band) {
+	const int kNumBands[] = { 2, 4, 7 };
+	vector<LineDetection> single, banded, banded_threaded;
+	TIMED("One band") Detect(image, 1, 1, single);
+	for (int i = 0; i < sizeof(kNumBands)/sizeof(kNumBands[0]); i++) {
+		const int n = kNumBands[i];
+		TIMED("Bands on one thread") Detect(image, n, 1, banded);
+		TIMED("Bands on many threads") Detect(image, n, 8, banded_threaded);
+		CHECK(SameDetections(banded, banded_threaded))
+			<< "Detections with " << n << " bands depend on the number of threads";
+
+		DLOG << n << " bands: " << banded.size() << " detections, "
+				 << single.size() << " with one band";
+		if (expect_same_as_one_band) {
+			CHECK(SameDetections(single, banded))
+				<< "Detections with " << n << " bands differ from one band";
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	InitVars(argc, argv);
+
+	// Vertical stripes that cross every band border. Every pixel on a
+	// stripe edge has the same orientation, so merging across borders
+	// must reproduce the single flood fill exactly.
+	ImageBundle stripes;
+	stripes.rgb.AllocImageData(320, 240);
+	for (int y = 0; y < 240; y++) {
+		for (int x = 0; x < 320; x++) {
+			const byte v = (x/10) % 3 == 0 ? 255 : 0;
+			stripes.rgb[y][x] = PixelRGB<byte>(v, v, v);
+		}
+	}
+	TITLED("Stripes") CheckBands(stripes, true);
+
+	// Optionally check a real image too, for which merging is only
+	// approximate
+	if (argc > 1) {
+		ImageBundle image(argv[1]);
+		TITLED("Image") CheckBands(image, false);
+	}
+
+	DLOG << "Detections do not depend on the number of threads";
+	return 0;
+}
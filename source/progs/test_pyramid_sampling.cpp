@@ -0,0 +1,131 @@
+#include "entrypoint_types.h"
+#include "gaussian_pyramid.h"
+#include "timer.h"
+
+#include "numeric_utils.tpp"
+#include "vector_utils.tpp"
+
+// Check that SampleSlice reproduces the slices computed by ComputeCube
+void CheckSlices(const GaussianPyramid& pyramid, const GaussianPyramid& cube) {
+	const int nx = cube.slices[0].Cols();
+	const int ny = cube.slices[0].Rows();
+	for (int i = 0; i < cube.slices.size(); i++) {
+		const MatF& slice = cube.slices[i];
+
+		// Every pixel
+		for (int y = 0; y < ny; y++) {
+			for (int x = 0; x < nx; x++) {
+				CHECK_EQ(pyramid.SampleSlice(i, x, y), slice[y][x])
+					<< "Level " << i << " differs at " << x << "," << y;
+			}
+		}
+
+		// Tiles, some of which overlap the image border
+		MatF tile;
+		for (int j = 0; j < 10; j++) {
+			const int x0 = rand() % (nx+20) - 10;
+			const int y0 = rand() % (ny+20) - 10;
+			const int w = rand() % 40 + 1;
+			const int h = rand() % 40 + 1;
+			pyramid.SampleSlice(i, x0, y0, w, h, tile);
+			for (int y = 0; y < h; y++) {
+				for (int x = 0; x < w; x++) {
+					CHECK_EQ(tile[y][x], slice[Clamp(y0+y, 0, ny-1)][Clamp(x0+x, 0, nx-1)])
+						<< "Level " << i << " tile at " << x0 << "," << y0
+						<< " differs at " << x << "," << y;
+				}
+			}
+		}
+	}
+}
+
+// Check that the features match the slices shifted with ShiftHoriz and
+// ShiftVert, as they were computed before features were sampled lazily
+void CheckFeatures(const PyramidFeatureGen& gen,
+									 const GaussianPyramid& cube,
+									 double nbr_dist) {
+	const int nx = cube.slices[0].Cols();
+	const int ny = cube.slices[0].Rows();
+	CHECK_EQ(gen.num_features(), cube.slices.size()*5);
+	CHECK_EQ(gen.features.size(), gen.num_features());
+
+	MatF expected, tile;
+	vector<float> all(gen.num_features());
+	for (int f = 0; f < gen.num_features(); f++) {
+		const MatF& slice = cube.slices[f/5];
+		const int scale = nbr_dist * (1 << (f/5));
+		switch (f%5) {
+		case 0: expected = slice; break;
+		case 1: ShiftHoriz(slice, expected, -scale); break;
+		case 2: ShiftVert(slice, expected, -scale); break;
+		case 3: ShiftHoriz(slice, expected, scale); break;
+		case 4: ShiftVert(slice, expected, scale); break;
+		}
+
+		for (int y = 0; y < ny; y++) {
+			for (int x = 0; x < nx; x++) {
+				CHECK_EQ(gen.Sample(f, x, y), expected[y][x])
+					<< "Feature " << f << " differs at " << x << "," << y;
+				CHECK_EQ((*gen.features[f])[y][x], expected[y][x])
+					<< "Dense feature " << f << " differs at " << x << "," << y;
+			}
+		}
+
+		for (int j = 0; j < 10; j++) {
+			const int w = rand() % min(nx, 40) + 1;
+			const int h = rand() % min(ny, 40) + 1;
+			const int x0 = rand() % (nx-w+1);
+			const int y0 = rand() % (ny-h+1);
+			gen.SampleTile(f, x0, y0, w, h, tile);
+			for (int y = 0; y < h; y++) {
+				for (int x = 0; x < w; x++) {
+					CHECK_EQ(tile[y][x], expected[y0+y][x0+x])
+						<< "Feature " << f << " tile at " << x0 << "," << y0
+						<< " differs at " << x << "," << y;
+				}
+			}
+		}
+	}
+
+	// All features at once
+	for (int j = 0; j < 100; j++) {
+		const int x = rand() % nx;
+		const int y = rand() % ny;
+		gen.Sample(x, y, &all[0]);
+		for (int f = 0; f < gen.num_features(); f++) {
+			CHECK_EQ(all[f], (*gen.features[f])[y][x]);
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	InitVars(argc, argv);
+
+	// Sizes must be divisible by 2^(num_scales-1)
+	srand(0);
+	const int kNumScales = 4;
+	const double kNbrDist = 2.5;
+	const int kSizes[][2] = { { 8, 8 }, { 64, 48 }, { 320, 240 }, { 328, 96 } };
+	for (int i = 0; i < sizeof(kSizes)/sizeof(kSizes[0]); i++) {
+		TITLE("Checking " << kSizes[i][0] << "x" << kSizes[i][1] << " input");
+		MatF input(kSizes[i][1], kSizes[i][0]);
+		for (int y = 0; y < input.Rows(); y++) {
+			for (int x = 0; x < input.Cols(); x++) {
+				input[y][x] = 1.0f * rand() / RAND_MAX;
+			}
+		}
+
+		GaussianPyramid cube;
+		TIMED("Compute cube") cube.ComputeCube(input, kNumScales);
+		GaussianPyramid pyramid;
+		TIMED("Compute levels") pyramid.ComputeLevels(input, kNumScales);
+		CheckSlices(pyramid, cube);
+
+		PyramidFeatureGen gen;
+		TIMED("Compute dense features") gen.ComputeDense(input, kNumScales, kNbrDist);
+		CheckFeatures(gen, cube, kNbrDist);
+	}
+
+	DLOG << "Sampled pyramid features match the upsampled slices";
+	return 0;
+}
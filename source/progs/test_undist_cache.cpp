@@ -0,0 +1,70 @@
+#include "entrypoint_types.h"
+#include "guided_line_detector.h"
+#include "line_detector.h"
+#include "map.h"
+#include "map_io.h"
+#include "timer.h"
+
+#include "format_utils.tpp"
+
+bool SameVector(const Vec3& a, const Vec3& b) {
+	return a[0] == b[0] && a[1] == b[1] && a[2] == b[2];
+}
+
+bool SameDetections(const GuidedLineDetector& a, const GuidedLineDetector& b) {
+	for (int i = 0; i < 3; i++) {
+		if (a.detections[i].size() != b.detections[i].size()) return false;
+		for (int j = 0; j < a.detections[i].size(); j++) {
+			const LineDetection& da = a.detections[i][j];
+			const LineDetection& db = b.detections[i][j];
+			if (!SameVector(da.seg.start, db.seg.start)) return false;
+			if (!SameVector(da.seg.end, db.seg.end)) return false;
+			if (da.num_pixels != db.num_pixels) return false;
+			if (!equal(da.pixels().begin(), da.pixels().end(), db.pixels().begin())) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+int main(int argc, char **argv) {
+	InitVars(argc, argv);
+
+	Map map;
+	proto::TruthedMap gt_map;
+	LoadXmlMapWithGroundTruth(GetMapPath("lab_kitchen1"), map, gt_map);
+
+	GuidedLineDetector cached;
+	GuidedLineDetector uncached;
+	uncached.use_undist_cache = false;
+
+	// Revisit some frames to check that cached maps are stable
+	const int kFrames[] = { 0, 10, 25, 10, 40, 0 };
+	for (int i = 0; i < sizeof(kFrames)/sizeof(kFrames[0]); i++) {
+		Frame& frame = map.frames[kFrames[i]];
+		frame.LoadImage();
+
+		TIMED ("Detect with cache")
+			cached.Compute(frame.image);
+		TIMED ("Detect without cache")
+			uncached.Compute(frame.image);
+
+		for (int j = 0; j < 3; j++) {
+			CHECK(cached.undist->rays[j] == uncached.undist->rays[j])
+				<< "Undistort maps differ for frame " << kFrames[i];
+		}
+		CHECK(SameDetections(cached, uncached))
+			<< "Detections differ for frame " << kFrames[i];
+
+		// All frames share one camera so they should share one map
+		shared_ptr<const UndistortMap> m =
+			UndistortMap::GetShared(frame.image.sz(), frame.image.pc().camera());
+		CHECK_EQ(m.get(), cached.undist.get());
+
+		frame.UnloadImage();
+	}
+
+	DLOG << "All detections identical with and without the undistort cache";
+	return 0;
+}
@@ -0,0 +1,128 @@
+#include <TooN/se3.h>
+#include <TooN/so3.h>
+
+#include "entrypoint_types.h"
+#include "camera.h"
+#include "vpt_utils.h"
+#include "vanishing_point_model.h"
+#include "timer.h"
+
+static const double kLineSigmaSqr = 6.;
+static const int kNumFrames = 12;
+static const int kNumSegmentsPerAxis = 8;
+static const int kNumSpurious = 5;
+
+// Tolerance relative to the magnitude of the values compared. The batched
+// kernels sum in a different order so results are not bitwise equal.
+static const double kTolerance = 1e-9;
+
+double RandomUniform(double a, double b) {
+	return a + (b-a) * rand() / RAND_MAX;
+}
+
+void CheckClose(double a, double b, const string& what) {
+	CHECK_LE(abs(a-b), kTolerance * max(1., max(abs(a), abs(b))))
+		<< what << " differs: " << a << " vs " << b;
+}
+
+// Compare the batched posterior, expected log likelihood, and gradient
+// with the per-observation versions at rotation R
+void CheckBatch(const VanishingPointModel& model,
+								const vector<LineObservation>& observations,
+								const SO3<>& R) {
+	LineObservationBatch batch(observations);
+	CHECK_EQ(batch.size(), observations.size());
+	const int n = observations.size();
+
+	MatD resps(n, 4), batch_resps(n, 4);
+	TIMED("Scalar posterior") model.ComputePosteriorOnLabels(observations, R, resps);
+	TIMED("Batched posterior") model.ComputeBatchPosteriorOnLabels(batch, R, batch_resps);
+	for (int i = 0; i < n; i++) {
+		for (int k = 0; k < 4; k++) {
+			CheckClose(resps[i][k], batch_resps[i][k], "Posterior");
+		}
+	}
+
+	double loglik, batch_loglik;
+	TIMED("Scalar log likelihood")
+		loglik = model.ComputeExpectedLogLik(observations, resps, R);
+	TIMED("Batched log likelihood")
+		batch_loglik = model.ComputeBatchExpectedLogLik(batch, resps, R);
+	CheckClose(loglik, batch_loglik, "Expected log likelihood");
+
+	Vec3 grad, batch_grad;
+	TIMED("Scalar gradient")
+		grad = model.ComputeExpectedLogLikGradient(observations, resps, R);
+	TIMED("Batched gradient")
+		batch_grad = model.ComputeBatchExpectedLogLikGradient(batch, resps, R);
+	const double scale = max(1., norm(grad));
+	for (int i = 0; i < 3; i++) {
+		CHECK_LE(abs(grad[i]-batch_grad[i]), kTolerance * scale)
+			<< "Gradient differs: " << grad << " vs " << batch_grad;
+	}
+	DLOG << "Log likelihood " << loglik << ", gradient " << grad;
+}
+
+int main(int argc, char **argv) {
+	InitVars(argc, argv);
+	srand(0);
+
+	int nx = 640, ny = 480;
+	Vec2I size = makeVector(nx, ny);
+	Mat3 H = Identity;
+	H[0] = makeVector(nx/2., 0, nx/2.);
+	H[1] = makeVector(0, ny/2., ny/2.);
+	LinearCamera intrinsics(H, size);
+
+	// Sample line segments aligned with one rotation in several frames
+	SO3<> R = SO3<>::exp(makeVector(RandomUniform(-1, 1),
+																	RandomUniform(-1, 1),
+																	RandomUniform(-1, 1)));
+	LineSegmentSampler sampler(kLineSigmaSqr);
+	vector<PosedCamera> cameras(kNumFrames);
+	vector<vector<LineSegment> > segments(kNumFrames);
+	for (int i = 0; i < kNumFrames; i++) {
+		Vector<6> v;
+		for (int j = 0; j < 6; j++) {
+			v[j] = RandomUniform(-.3, .3);
+		}
+		cameras[i] = PosedCamera(SE3<>::exp(v), &intrinsics);
+
+		for (int k = 0; k < 3; k++) {
+			Vec3 vpt = ProjectVanishingPoint(k, R, cameras[i]);
+			for (int j = 0; j < kNumSegmentsPerAxis; j++) {
+				segments[i].push_back(sampler.Sample(vpt, size));
+			}
+		}
+		for (int j = 0; j < kNumSpurious; j++) {
+			Vec3 a = makeVector(RandomUniform(0, nx), RandomUniform(0, ny), 1);
+			Vec3 b = makeVector(RandomUniform(0, nx), RandomUniform(0, ny), 1);
+			segments[i].push_back(LineSegment(a, b));
+		}
+	}
+
+	// Interleave the frames so that batching must regroup them
+	vector<LineObservation> observations;
+	for (int j = 0; j < segments[0].size(); j++) {
+		for (int i = 0; i < kNumFrames; i++) {
+			if (j < segments[i].size()) {
+				observations.push_back(LineObservation(&cameras[i], segments[i][j]));
+			}
+		}
+	}
+	DLOG << "Sampled " << observations.size() << " observations in "
+			 << kNumFrames << " frames";
+
+	// Check at the true rotation and at perturbations of it
+	VanishingPointModel model(kLineSigmaSqr);
+	TITLED("At true rotation") CheckBatch(model, observations, R);
+	for (int i = 0; i < 3; i++) {
+		Vec3 w = makeVector(RandomUniform(-.2, .2),
+												RandomUniform(-.2, .2),
+												RandomUniform(-.2, .2));
+		TITLED("At perturbed rotation") CheckBatch(model, observations, R * SO3<>::exp(w));
+	}
+
+	DLOG << "Batched kernels match the per-observation versions";
+	return 0;
+}
@@ -2,6 +2,8 @@
 
 #include <stdlib.h>
 
+#include <fstream>
+
 #include <boost/ptr_container/ptr_vector.hpp>
 #include <boost/filesystem.hpp>
 
@@ -20,6 +22,32 @@
 #include "format_utils.tpp"
 
 namespace indoor_context {
+	// Names of gvars that affect the line sweep features
+	static const char* kSweepVars[] = {
+		"Gradients.SmoothingSigma",
+		"GuidedLineDetector.DistThresh",
+		"GuidedLineDetector.MagThresh",
+		"GuidedLineDetector.MinPeak",
+		"LineSweeper.BlockMarginSqr",
+		"ManhattanDP.DefaultWallPenalty",
+		"ManhattanDP.DefaultOcclusionPenalty"
+	};
+
+	// Names of gvars that affect the point cloud features
+	static const char* kPointCloudVars[] = {
+		"LandmarkPayoffs.AgreeSigma"
+	};
+
+	// Add the pose of a camera to a cache key
+	static void AddPoseToKey(const PosedCamera& pc, PayoffCacheKey& key) {
+		Vec6 ln = pc.pose().ln();
+		for (int i = 0; i < 6; i++) {
+			key.Add(ln[i]);
+		}
+		key.Add(pc.nx());
+		key.Add(pc.ny());
+	}
+
 	void PredictGridLabels(const ManhattanHypothesis& hyp,
 												 const DPGeometry& geometry,
 												 MatI& grid_orientations) {
@@ -227,6 +255,7 @@ namespace indoor_context {
 		// Accumulate statistics
 		BOOST_FOREACH(TrainingInstance& instance, instances) {
 			fmgr.LoadFeaturesFor(instance);
+			fmgr.LoadAllFeatures();
 			CHECK_EQ(fmgr.feature_set.features.size(), nf);
 			for (int f = 0; f < nf; f++) {
 				for (int k = 0; k < 2; k++) {
@@ -240,9 +269,12 @@ namespace indoor_context {
 			}
 		}
 
-		// Normalize features
+		// Normalize features. The normalized features no longer match
+		// the cache so they are committed without cache keys.
 		BOOST_FOREACH(TrainingInstance& instance, instances) {
 			fmgr.LoadFeaturesFor(instance);
+			fmgr.LoadAllFeatures();
+			fmgr.feature_keys.clear();
 			for (int f = 0; f < nf; f++) {
 				double mean = sums[f] / norms[f];
 				double stddev = sqrt(sum_sqrs[f]/norms[f] - mean*mean);
@@ -292,16 +324,86 @@ namespace indoor_context {
 	}
 
 	FeatureManager::FeatureManager(const string& dir)
-		: feature_dir(dir) {
+		: feature_dir(dir), path_table_valid(false) {
 		CHECK(fs::exists(dir));
 	}
 
+	void FeatureManager::EnableCache(const string& dir) {
+		cache.reset(new PayoffCache(dir));
+	}
+
+	PayoffCacheKey FeatureManager::GetCacheKey(const TrainingInstance& instance,
+																						 const string& feature_name) const {
+		PayoffCacheKey key;
+		key.Add(feature_name);
+		key.Add(instance.sequence);
+		key.Add(instance.frame->id);
+		AddPoseToKey(instance.frame->image.pc(), key);
+		key.Add(instance.geometry.zfloor);
+		key.Add(instance.geometry.zceil);
+		key.Add(instance.geometry.grid_size[0]);
+		key.Add(instance.geometry.grid_size[1]);
+		return key;
+	}
+
+	bool FeatureManager::AddCachedFeature(const PayoffCacheKey& key) {
+		if (!cache) return false;
+		string desc;
+		DPPayoffs payoffs;
+		if (!cache->Load(key, payoffs, desc)) return false;
+		feature_set.AddCopy(payoffs, desc);
+		feature_keys.push_back(key);
+		return true;
+	}
+
+	void FeatureManager::CacheLastFeature(const PayoffCacheKey& key) {
+		if (!cache) return;
+		CHECK(!feature_set.features.empty());
+		cache->Store(key,
+								 feature_set.features.back(),
+								 feature_set.descriptions.back());
+		feature_keys.push_back(key);
+	}
+
+	const DPPayoffs& FeatureManager::GetPayoffs(int i) const {
+		CHECK_INDEX(i, feature_set.features);
+		if (!feature_loaded.empty() && !feature_loaded[i]) {
+			CHECK(cache) << "Features were loaded from an index but the cache is disabled";
+			string desc;
+			CHECK(cache->Load(feature_keys[i], feature_set.features[i], desc))
+				<< "Missing cache entry: " << cache->GetPathFor(feature_keys[i]);
+			feature_loaded[i] = true;
+		}
+		return feature_set.features[i];
+	}
+
+	void FeatureManager::LoadAllFeatures() const {
+		if (feature_loaded.empty()) return;
+		for (int i = 0; i < feature_set.features.size(); i++) {
+			GetPayoffs(i);
+		}
+		feature_loaded.clear();
+	}
+
+	void FeatureManager::ClearFeatures() {
+		feature_set.Clear();
+		feature_keys.clear();
+		feature_loaded.clear();
+		path_table_valid = false;
+	}
+
 	string FeatureManager::GetPathFor(const TrainingInstance& instance) {
 		boost::format pat("%s_frame%03d_features.protodata");
 		string filename = str(pat % instance.sequence % instance.frame->id);
 		return (fs::path(feature_dir) / filename).string();
 	}
 
+	string FeatureManager::GetIndexPathFor(const TrainingInstance& instance) {
+		boost::format pat("%s_frame%03d_features.index");
+		string filename = str(pat % instance.sequence % instance.frame->id);
+		return (fs::path(feature_dir) / filename).string();
+	}
+
 	int FeatureManager::NumFeatures() const {
 		return feature_set.features.size();
 	}
@@ -312,23 +414,34 @@ namespace indoor_context {
 				 << instance.sequence << ":" << instance.frame->id;
 
 		last_instance = &instance;
-		feature_set.Clear();
+		ClearFeatures();
 
 		const PosedImage& image = instance.frame->image;
 			
 		// Compute monocular features
-		objective_gen.Compute(image);
-		mono_gen.Compute(objective_gen.objective, instance.geometry);
-		feature_set.AddCopy(mono_gen.payoffs, "Line sweeps");
+		ComputeSweepFeature(instance);
 
 		// Compute 3D features
-		vector<Vec3> point_cloud;
-		instance.frame->GetMeasuredPoints(point_cloud);
-		point_cloud_gen.Compute(point_cloud, image.pc(), instance.geometry);
-		feature_set.AddCopy(point_cloud_gen.agreement_payoffs,
-												"Point cloud (ON)");
-		feature_set.AddCopy(point_cloud_gen.occlusion_payoffs,
-												"Point cloud (IN)");
+		PayoffCacheKey agree_key = GetCacheKey(instance, "Point cloud (ON)");
+		PayoffCacheKey occl_key = GetCacheKey(instance, "Point cloud (IN)");
+		BOOST_FOREACH(const char* var, kPointCloudVars) {
+			agree_key.AddVar(var);
+			occl_key.AddVar(var);
+		}
+		if (!cache || !cache->Contains(agree_key) || !cache->Contains(occl_key)) {
+			vector<Vec3> point_cloud;
+			instance.frame->GetMeasuredPoints(point_cloud);
+			point_cloud_gen.Compute(point_cloud, image.pc(), instance.geometry);
+			feature_set.AddCopy(point_cloud_gen.agreement_payoffs,
+													"Point cloud (ON)");
+			CacheLastFeature(agree_key);
+			feature_set.AddCopy(point_cloud_gen.occlusion_payoffs,
+													"Point cloud (IN)");
+			CacheLastFeature(occl_key);
+		} else {
+			CHECK(AddCachedFeature(agree_key));
+			CHECK(AddCachedFeature(occl_key));
+		}
 
 		// Compute stereo features
 		BOOST_FOREACH(int offset, stereo_offsets) {
@@ -342,11 +455,35 @@ namespace indoor_context {
 				}
 				aux_frame = instance.frame->map->GetFrameById(aux_id);
 			}
-					
-			aux_frame->LoadImage();
-			stereo_gen.Compute(image, aux_frame->image, instance.geometry);
-			feature_set.AddCopy(stereo_gen.payoffs, fmt("Stereo (offset %+d)",offset));
+
+			// The key depends on the auxiliary frame rather than the offset
+			// so that entries are shared between overlapping offset sets
+			string desc = fmt("Stereo (offset %+d)",offset);
 			// the plus sign above forces a sign character to be included
+			PayoffCacheKey key = GetCacheKey(instance, "Stereo");
+			key.Add(aux_id);
+			AddPoseToKey(aux_frame->image.pc(), key);
+			if (AddCachedFeature(key)) {
+				feature_set.descriptions.back() = desc;
+			} else {
+				aux_frame->LoadImage();
+				stereo_gen.Compute(image, aux_frame->image, instance.geometry);
+				feature_set.AddCopy(stereo_gen.payoffs, desc);
+				CacheLastFeature(key);
+			}
+		}
+	}
+
+	void FeatureManager::ComputeSweepFeature(const TrainingInstance& instance) {
+		PayoffCacheKey key = GetCacheKey(instance, "Line sweeps");
+		BOOST_FOREACH(const char* var, kSweepVars) {
+			key.AddVar(var);
+		}
+		if (!AddCachedFeature(key)) {
+			objective_gen.Compute(instance.frame->image);
+			mono_gen.Compute(objective_gen.objective, instance.geometry);
+			feature_set.AddCopy(mono_gen.payoffs, "Line sweeps");
+			CacheLastFeature(key);
 		}
 	}
 
@@ -355,14 +492,10 @@ namespace indoor_context {
 				 << instance.sequence << ":" << instance.frame->id;
 
 		last_instance = &instance;
-		feature_set.Clear();
+		ClearFeatures();
 
-		const PosedImage& image = instance.frame->image;
-			
 		// Compute monocular features
-		objective_gen.Compute(image);
-		mono_gen.Compute(objective_gen.objective, instance.geometry);
-		feature_set.AddCopy(mono_gen.payoffs, "Line sweeps");
+		ComputeSweepFeature(instance);
 	}
 
 	void FeatureManager::ComputeMonoFeatures(const TrainingInstance& instance,
@@ -374,7 +507,7 @@ namespace indoor_context {
 		DLOG << "Computing single-view features for frame "
 				 << instance.sequence << ":" << instance.frame->id;
 
-		feature_set.Clear();
+		ClearFeatures();
 		last_instance = &instance;
 
 		// Compute features
@@ -396,7 +529,7 @@ namespace indoor_context {
 	void FeatureManager::ComputeMockFeatures(const TrainingInstance& instance) {
 		DLOG << "Computing mock features for frame " << instance.frame->id;
 		
-		feature_set.Clear();
+		ClearFeatures();
 		last_instance = &instance;
 
 		int ny = instance.geometry.ny();
@@ -426,33 +559,66 @@ namespace indoor_context {
 	}
 
 	void FeatureManager::CommitFeatures() {
+		// The features may have been modified since the table was computed
+		path_table_valid = false;
+		LoadAllFeatures();
 		WriteFeatures(GetPathFor(*last_instance), feature_set);
+
+		// If every feature is in the cache then record the cache keys so
+		// that LoadFeaturesFor can read each feature only when it is used
+		string index_path = GetIndexPathFor(*last_instance);
+		if (cache && feature_keys.size() == feature_set.features.size()) {
+			ofstream index(index_path.c_str());
+			for (int i = 0; i < feature_keys.size(); i++) {
+				index << feature_keys[i].ToString() << " "
+							<< feature_set.descriptions[i] << endl;
+			}
+		} else if (fs::exists(index_path)) {
+			fs::remove(index_path);
+		}
 	}
 
 	void FeatureManager::LoadFeaturesFor(const TrainingInstance& instance) {
 		if (&instance != last_instance) {
-			string path = GetPathFor(instance);
-			CHECK(fs::exists(path)) << "Looking for features at " << path;
-			TIMED("Loading features") ReadFeatures(path, feature_set);
+			ClearFeatures();
+			string index_path = GetIndexPathFor(instance);
+			if (cache && fs::exists(index_path)) {
+				// Read only the keys and descriptions here. GetPayoffs reads
+				// the features themselves.
+				ifstream index(index_path.c_str());
+				string hash, desc;
+				while (index >> hash && getline(index, desc)) {
+					PayoffCacheKey key;
+					key.FromString(hash);
+					feature_keys.push_back(key);
+					feature_set.features.push_back(new DPPayoffs);
+					feature_set.descriptions.push_back(desc.substr(1));
+					feature_loaded.push_back(false);
+				}
+			} else {
+				string path = GetPathFor(instance);
+				CHECK(fs::exists(path)) << "Looking for features at " << path;
+				TIMED("Loading features") ReadFeatures(path, feature_set);
+			}
 			last_instance = &instance;
 		}
 	}
 
 	void FeatureManager::Compile(const ManhattanHyperParameters& params,
 															 DPPayoffs& payoffs) {
+		LoadAllFeatures();
 		feature_set.Compile(params, payoffs);
 	}
 
 	void FeatureManager::CompileWithLoss(const ManhattanHyperParameters& params,
 																			 const TrainingInstance& instance,
 																			 DPPayoffs& payoffs) {
-		Compile(params, payoffs);
-		payoffs.Add(instance.loss_terms);
+		LoadAllFeatures();
+		feature_set.CompileWithLoss(params, instance.loss_terms, payoffs);
 	}
 
 	MatF FeatureManager::GetFeature(int i, int orient) const {
-		CHECK_INDEX(i, feature_set.features);
-		return feature_set.features[i].wall_scores[orient];
+		return GetPayoffs(i).wall_scores[orient];
 	}
 
 	const string& FeatureManager::GetFeatureComment(int i) const {
@@ -460,14 +626,39 @@ namespace indoor_context {
 		return feature_set.descriptions[i];
 	}
 
+	void FeatureManager::ComputePathTable() const {
+		if (path_table_valid) return;
+
+		int nf = feature_set.features.size();
+		if (nf == 0) return;  // there is nothing to tabulate
+		LoadAllFeatures();
+		int nx = feature_set.features[0].nx();
+		int ny = feature_set.features[0].ny();
+		for (int a = 0; a < 2; a++) {
+			path_table[a].Resize(nx*ny, nf);
+			for (int f = 0; f < nf; f++) {
+				const MatF& ftr = feature_set.features[f].wall_scores[a];
+				CHECK_EQ(matrix_size(ftr), makeVector(nx,ny));
+				for (int y = 0; y < ny; y++) {
+					const float* row = ftr[y];
+					for (int x = 0; x < nx; x++) {
+						path_table[a][y*nx+x][f] = row[x];
+					}
+				}
+			}
+		}
+		path_table_valid = true;
+	}
+
 	VecD FeatureManager::ComputeFeatureForHypothesis(const ManhattanHypothesis& hyp) const {
 		int nf = feature_set.features.size();
 		VecD ftr(nf+2, 0);
 		for (int f = 0; f < nf; f++) {
+			const DPPayoffs& payoffs = GetPayoffs(f);
 			for (int i = 0; i < hyp.path_ys.size(); i++) {
 				int a = hyp.path_axes[i];
 				int y = hyp.path_ys[i];
-				ftr[f] += feature_set.features[f].wall_scores[a][y][i];
+				ftr[f] += payoffs.wall_scores[a][y][i];
 			}
 		}
 		// These two are negative since extra walls are *penalised*: important!
@@ -475,4 +666,37 @@ namespace indoor_context {
 		ftr[nf+1] = -hyp.num_occlusions;
 		return ftr;
 	}
+
+	MatD FeatureManager::ComputeFeaturesForHypotheses(const vector<ManhattanHypothesis>& hyps) const {
+		int nf = feature_set.features.size();
+		MatD ftrs(hyps.size(), nf+2, 0.);
+		// With no feature planes only the penalty terms remain
+		if (nf > 0) {
+			ComputePathTable();
+		}
+		for (int i = 0; i < hyps.size(); i++) {
+			const ManhattanHypothesis& hyp = hyps[i];
+			double* ftr = ftrs[i];
+			if (nf > 0) {
+				int nx = feature_set.features[0].nx();
+				int ny = feature_set.features[0].ny();
+				CHECK_EQ(hyp.path_ys.size(), nx);
+				// Each step along the path reads one contiguous row of the table
+				for (int x = 0; x < nx; x++) {
+					int a = hyp.path_axes[x];
+					int y = hyp.path_ys[x];
+					CHECK_INTERVAL(a, 0, 1);
+					CHECK_INTERVAL(y, 0, ny-1);
+					const float* cell = path_table[a][y*nx+x];
+					for (int f = 0; f < nf; f++) {
+						ftr[f] += cell[f];
+					}
+				}
+			}
+			// These two are negative since extra walls are *penalised*: important!
+			ftr[nf] = -hyp.num_corners;
+			ftr[nf+1] = -hyp.num_occlusions;
+		}
+		return ftrs;
+	}
 }
@@ -136,7 +136,16 @@ namespace indoor_context {
 	class FeatureManager {
 	public:
 		string feature_dir;
-		PayoffFeatures feature_set;
+		// The features for last_instance. Features loaded from an index
+		// are read from the cache on first use (see GetPayoffs), so this
+		// is mutable.
+		mutable PayoffFeatures feature_set;
+		// The cache key of each feature in feature_set. Empty or
+		// incomplete if any feature was not cached or was modified since.
+		vector<PayoffCacheKey> feature_keys;
+		// feature_loaded[i] is false if feature i has not yet been read
+		// from the cache. Empty once all features are loaded.
+		mutable vector<bool> feature_loaded;
 		const TrainingInstance* last_instance;
 
 		LineSweepObjectiveGen objective_gen;
@@ -146,17 +155,59 @@ namespace indoor_context {
 
 		FeaturePayoffGen payoff_gen;
 
+		// The features re-arranged so that path_table[a][y*nx+x][f] is
+		// feature f for placing a wall with axis a at (x,y). Computed
+		// lazily by ComputePathTable().
+		mutable MatF path_table[2];
+		mutable bool path_table_valid;
+
+		// If not null then computed features are stored here and re-used
+		// whenever all their inputs are unchanged
+		scoped_ptr<PayoffCache> cache;
+
 		// Constructor for a particular dir
 		FeatureManager(const string& dir);
 
+		// Enable the per-feature cache in the given directory
+		void EnableCache(const string& dir);
+		// Get the cache key for a feature of a given instance. The key
+		// covers the sequence, frame, pose, and geometry but not any
+		// feature-specific parameters, which must be added by the caller.
+		PayoffCacheKey GetCacheKey(const TrainingInstance& instance,
+															 const string& feature_name) const;
+		// Load a feature from the cache and append it to the feature
+		// set. Returns false if the cache is disabled or does not
+		// contain the key.
+		bool AddCachedFeature(const PayoffCacheKey& key);
+		// Store the most recently appended feature in the cache
+		void CacheLastFeature(const PayoffCacheKey& key);
+		// Get the i-th feature, reading it from the cache if necessary
+		const DPPayoffs& GetPayoffs(int i) const;
+		// Read any features that have not yet been read from the cache
+		void LoadAllFeatures() const;
+		// Clear the current features
+		void ClearFeatures();
+
 		// Get the file for a specific instance
 		string GetPathFor(const TrainingInstance& instance);
+		// Get the file listing the cache keys of the features for an
+		// instance
+		string GetIndexPathFor(const TrainingInstance& instance);
 		// Get the i-th feature matrix
 		MatF GetFeature(int i, int orient) const;
 		// Get the description string associated with a feature
 		const string& GetFeatureComment(int i) const;
-		// Compile features into a payoff matrix
+		// Compute the joint feature vector for a hypothesis. This reads
+		// the features directly, which is cheaper than building the path
+		// table for a single hypothesis.
 		VecD ComputeFeatureForHypothesis(const ManhattanHypothesis& soln) const;
+		// Compute joint feature vectors for many hypotheses at once. The
+		// i-th row of the result is the feature for the i-th hypothesis.
+		MatD ComputeFeaturesForHypotheses(const vector<ManhattanHypothesis>& hyps) const;
+		// Re-arrange the current features so that all features for a
+		// given cell are contiguous (see path_table below). Does nothing
+		// if the table is already up to date.
+		void ComputePathTable() const;
 
 		// Get the number of features
 		int NumFeatures() const;
@@ -174,6 +225,8 @@ namespace indoor_context {
 														 const string& spec);
 		// Compute a single feature for line sweeps (for ECCV comparison)
 		void ComputeSweepFeatures(const TrainingInstance& instance);
+		// Append the line sweep feature to the current feature set
+		void ComputeSweepFeature(const TrainingInstance& instance);
 		// Compute mock features for testing
 		void ComputeMockFeatures(const TrainingInstance& instance);
 
@@ -124,6 +124,7 @@ BOOST_PYTHON_MODULE(py_indoor_context) {
 	RegisterSequenceConverter<vector<int> >();
 	RegisterSequenceConverter<vector<float> >();
 	RegisterSequenceConverter<vector<double> >();
+	RegisterSequenceConverter<vector<ManhattanHypothesis> >();
 
 	// TrainingInstance
 	class_<TrainingInstance, boost::noncopyable>("TrainingInstance")
@@ -193,6 +194,7 @@ BOOST_PYTHON_MODULE(py_indoor_context) {
 		.def("ComputeSweepFeatures", &FeatureManager::ComputeSweepFeatures)
 		.def("ComputeMonoFeatures", &FeatureManager::ComputeMonoFeatures)
 		.def("ComputeMockFeatures", &FeatureManager::ComputeMockFeatures)
+		.def("EnableCache", &FeatureManager::EnableCache)
 
 		.def("CommitFeatures", &FeatureManager::CommitFeatures)
 		.def("LoadFeaturesFor", &FeatureManager::LoadFeaturesFor)
@@ -207,6 +209,8 @@ BOOST_PYTHON_MODULE(py_indoor_context) {
 		.def("CompileWithLoss", &FeatureManager::CompileWithLoss)
 		.def("ComputeFeatureForHypothesis",
 				 &FeatureManager::ComputeFeatureForHypothesis)
+		.def("ComputeFeaturesForHypotheses",
+				 &FeatureManager::ComputeFeaturesForHypotheses)
 		;
 
 		/*class_<PhotometricFeatures, boost::noncopyable>("PhotometricFeatures")
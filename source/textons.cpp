@@ -20,6 +20,7 @@
 #include "progress_reporter.h"
 #include "image_bundle.h"
 #include "worker.h"
+#include "thread_pool.h"
 
 #include "io_utils.tpp"
 #include "image_utils.tpp"
@@ -45,6 +46,8 @@ namespace indoor_context {
 	const lazyvar<string> gvVocabFile("Textons.VocabFile");
 	// Strategy for filtering (CPU, CPUParallel, or GPU)
 	const lazyvar<string> gvFilterStrategy("Textons.FilterStrategy");
+	// Strategy for clustering the vocabulary (Lloyd or MiniBatch)
+	const lazyvar<string> gvKMeansStrategy("Textons.KMeansStrategy");
 
 	lazyvar<int> gvColorInfo("Textons.Features.ColorInfo");
 	lazyvar<float> gvGaborWeight("Textons.Features.GaborWeight");
@@ -56,6 +59,15 @@ namespace indoor_context {
 	lazyvar<float> gvSWeight("Textons.Features.SWeight");
 	lazyvar<float> gvVWeight("Textons.Features.VWeight");
 
+	// Number of words compared against each pixel at a time in the
+	// nearest word search. The words in one block stay in cache while
+	// all pixels in a row are compared against them.
+	static const int kWordBlockSize = 16;
+
+	// ComputeParallel splits the image into bands of this many rows, each
+	// of which is a separate job
+	static const int kRowsPerJob = 16;
+
 
 	TextonVocab::TextonVocab() {
 	}
@@ -75,34 +87,79 @@ namespace indoor_context {
 	void TextonVocab::Compute(const vector<ImageBundle*>& images) {
 		input = &images;
 
+		// Features are sampled on a grid with this spacing
+		const int kSampleStride = 3;
+
+		// Count samples so that they can be stored contiguously
+		int num_samples = 0;
+		for (int i = 0; i < images.size(); i++) {
+			num_samples += ((images[i]->ny()+kSampleStride-1) / kSampleStride) *
+				((images[i]->nx()+kSampleStride-1) / kSampleStride);
+		}
+
 		TextonFeatures ftrgen;
+		vector<float> rowftrs;
+		int next = 0;
 		ProgressReporter gen_prog(images.size(), "Generating features");
 		for (int i = 0; i < images.size(); i++) {
 			// Run the filters
 			ftrgen.Compute(*images[i]);
+			const int len = ftrgen.FeatureLen();
+			if (i == 0) {
+				sampled_features.Resize(num_samples, len);
+			}
+			CHECK_EQ(len, sampled_features.Cols());
 
 			// Compute the features
-			Vector<> feature(ftrgen.FeatureLen());;
-			for (int y = 0; y < images[i]->ny(); y+=3) {
-				for (int x = 0; x < images[i]->nx(); x+=3) {
-					ftrgen.Get(x, y, feature);
-					sampled_features.push_back(asVNL(feature));
+			rowftrs.resize(images[i]->nx() * len);
+			for (int y = 0; y < images[i]->ny(); y += kSampleStride) {
+				ftrgen.GetRow(y, &rowftrs[0]);
+				for (int x = 0; x < images[i]->nx(); x += kSampleStride) {
+					const float* ftr = &rowftrs[x*len];
+					copy(ftr, ftr+len, sampled_features[next++]);
 				}
 			}
 			gen_prog.Increment();
 		}
+		CHECK_EQ(next, num_samples);
 
 		// Run K-means to learn the texton exemplars
-		DLOG << "Sampled " << sampled_features.size() << " features";
+		DLOG << "Sampled " << sampled_features.Rows() << " features";
 		DLOG << "Running K-means...";
-		vector<VecD> exemplars;
-		VecI parents(sampled_features.size());
-		KMeans::Estimate(sampled_features, 15, exemplars, parents);
-
-		// Copy wrods to Toon format
+		const int kNumWords = 15;
 		words.clear();
-		Vector<>(*f)(const VecD&) = &asToon<double>;
-		transform_all_into(exemplars, words, f);
+		VecI parents;
+		if (*gvKMeansStrategy == "Lloyd") {
+			vector<VecD> pts;
+			for (int i = 0; i < sampled_features.Rows(); i++) {
+				VecD pt(sampled_features.Cols());
+				for (int j = 0; j < sampled_features.Cols(); j++) {
+					pt[j] = sampled_features[i][j];
+				}
+				pts.push_back(pt);
+			}
+			vector<VecD> exemplars;
+			parents.Resize(pts.size());
+			KMeans::Estimate(pts, kNumWords, exemplars, parents);
+
+			// Copy words to Toon format
+			Vector<>(*f)(const VecD&) = &asToon<double>;
+			transform_all_into(exemplars, words, f);
+		} else if (*gvKMeansStrategy == "MiniBatch") {
+			MatF exemplars;
+			KMeans::EstimateMiniBatch(sampled_features, kNumWords, exemplars, parents);
+
+			// Copy words to Toon format
+			for (int i = 0; i < exemplars.Rows(); i++) {
+				Vector<> word(exemplars.Cols());
+				for (int j = 0; j < exemplars.Cols(); j++) {
+					word[j] = exemplars[i][j];
+				}
+				words.push_back(word);
+			}
+		} else {
+			CHECK(false) << "Unknown K-means strategy: " << *gvKMeansStrategy;
+		}
 	}
 
 
@@ -213,6 +270,60 @@ namespace indoor_context {
 		}
 	}
 
+	void TextonFeatures::GetRow(int y, float* out) const {
+		const int nx = input->nx();
+		const int len = FeatureLen();
+		const int n = filters.responses.size();
+
+		// Filter responses, some of which are at reduced scales (see Get)
+		int shift = 0;
+		for (int i = 0; i < n; i++) {
+			const MatF& cur = *filters.responses[i];
+			if (i > 0 && cur.Rows() < filters.responses[i-1]->Rows()) {
+				shift++;
+			}
+			const float* resprow = cur[y >> shift];
+			float* outp = out + i;
+			for (int x = 0; x < nx; x++, outp += len) {
+				*outp = gabor_weight * resprow[x >> shift];
+			}
+		}
+
+		// Color features
+		float* outp = out + n;
+		switch (color_info) {
+		case kMono: {
+			const PixelF* monorow = input->mono[y];
+			for (int x = 0; x < nx; x++, outp += len) {
+				outp[0] = mono_weight * monorow[x].y;
+			}
+			break;
+		}
+		case kRGB: {
+			const PixelRGB<byte>* rgbrow = input->rgb[y];
+			for (int x = 0; x < nx; x++, outp += len) {
+				outp[0] = r_weight * rgbrow[x].r / 127.5;
+				outp[1] = g_weight * rgbrow[x].g / 127.5;
+				outp[2] = b_weight * rgbrow[x].b / 127.5;
+			}
+			break;
+		}
+		case kHSV: {
+			const PixelRGB<byte>* rgbrow = input->rgb[y];
+			for (int x = 0; x < nx; x++, outp += len) {
+				byte h, s, v;
+				Colors::RGB2HSV(rgbrow[x].r, rgbrow[x].g, rgbrow[x].b, h, s, v);
+				outp[0] = h_weight * h / 127.5;
+				outp[1] = s_weight * s / 127.5;
+				outp[2] = v_weight * v / 127.5;
+			}
+			break;
+		}
+		case kNone:
+			break;
+		}
+	}
+
 
 
 
@@ -227,15 +338,20 @@ namespace indoor_context {
 	void TextonMap::Compute(const ImageBundle& image) {
 		Reset(image);
 		ProcessRows(0, image.ny()-1);
+		CountTextons();
 	}
 
 
 	void TextonMap::ComputeParallel(const ImageBundle& image) {
-		const int kNumThreads = 4;
 		Reset(image);
-		ParallelPartition(image.ny(),
-											kNumThreads,
-											bind(&TextonMap::ProcessRows, ref(*this), _1, _2));
+		const int num_jobs = (image.ny()+kRowsPerJob-1) / kRowsPerJob;
+		thread_pool pool(max(1, min(Worker::DefaultNumThreads(), num_jobs)));
+		for (int y = 0; y < image.ny(); y += kRowsPerJob) {
+			const int last = min(y+kRowsPerJob, image.ny()) - 1;
+			pool.add(bind(&TextonMap::ProcessRows, ref(*this), y, last));
+		}
+		pool.join();
+		CountTextons();
 	}
 
 	void TextonMap::Reset(const ImageBundle& image) {
@@ -252,26 +368,68 @@ namespace indoor_context {
 
 		// Compute features
 		features.Compute(image);
+
+		// Copy the vocabulary into contiguous storage
+		const int nw = vocab.words.size();
+		const int len = features.FeatureLen();
+		CHECK_GT(nw, 0) << "The texton vocabulary is empty";
+		word_matrix.Resize(nw, len);
+		word_norms.Resize(nw);
+		for (int i = 0; i < nw; i++) {
+			CHECK_EQ(vocab.words[i].size(), len)
+				<< "Texton vocabulary does not match the current feature parameters";
+			float* row = word_matrix[i];
+			word_norms[i] = 0;
+			for (int j = 0; j < len; j++) {
+				row[j] = vocab.words[i][j];
+				word_norms[i] += row[j] * row[j];
+			}
+		}
 	}
 
 	void TextonMap::ProcessRows(const int r1, const int r2) {
-		Vector<> ftr(features.FeatureLen());
+		const int nx = map.Cols();
+		const int nw = word_matrix.Rows();
+		const int len = features.FeatureLen();
+
+		// Buffers for one row of pixels
+		vector<float> ftrs(nx * len);
+		vector<float> mindists(nx);
+
 		for (int y = r1; y <= r2; y++) {
 			int* maprow = map[y];
-			for (int x = 0; x < map.Cols(); x++) {
-				// Generate the feature vector for this pixel
-				features.Get(x, y, ftr);
-
-				// Find the nearest texon
-				double mindist = INFINITY;
-				for (int i = 0; i < vocab.words.size(); i++) {
-					const double dist = norm_sq(ftr - vocab.words[i]);
-					if (dist < mindist) {
-						mindist = dist;
-						maprow[x] = i;
+			features.GetRow(y, &ftrs[0]);
+			fill(mindists.begin(), mindists.end(), INFINITY);
+
+			// The nearest word minimizes |x|^2 - 2x.w + |w|^2, in which the
+			// first term is constant for each pixel so we drop it
+			for (int w0 = 0; w0 < nw; w0 += kWordBlockSize) {
+				const int w1 = min(w0 + kWordBlockSize, nw);
+				const float* x = &ftrs[0];
+				for (int c = 0; c < nx; c++, x += len) {
+					for (int i = w0; i < w1; i++) {
+						const float* w = word_matrix[i];
+						float dot = 0;
+						for (int j = 0; j < len; j++) {
+							dot += x[j] * w[j];
+						}
+						const float dist = word_norms[i] - 2*dot;
+						if (dist < mindists[c]) {
+							mindists[c] = dist;
+							maprow[c] = i;
+						}
 					}
 				}
-				texton_counts[maprow[x]]++;
+			}
+		}
+	}
+
+	void TextonMap::CountTextons() {
+		texton_counts.Fill(0);
+		for (int y = 0; y < map.Rows(); y++) {
+			const int* row = map[y];
+			for (int x = 0; x < map.Cols(); x++) {
+				texton_counts[row[x]]++;
 			}
 		}
 	}
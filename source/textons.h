@@ -13,8 +13,8 @@ namespace indoor_context {
 	public:
 		// The cluster centres in feature space
 		vector<toon::Vector<> > words;
-		// The features generated for the input images
-		vector<VecD> sampled_features;
+		// The features generated for the input images, one per row
+		MatF sampled_features;
 		// The images this vocab was generated from
 		const vector<ImageBundle*>* input;
 
@@ -57,6 +57,9 @@ namespace indoor_context {
 		int FeatureLen() const;
 		// Get the feature at (x,y)
 		void Get(int x, int y, toon::Vector<>& out_ftr) const;
+		// Get the features for every pixel in row y. Features are stored
+		// consecutively in out, which must have room for nx*FeatureLen()
+		void GetRow(int y, float* out) const;
 	private:
 		// Load values from GVars (called during construction)
 		void InitVars();
@@ -99,10 +102,17 @@ namespace indoor_context {
 		// Vizualize the part of an image assigned to texton i
 		void OutputTextonViz(const string& filename, const int texton) const;
 	private:
+		// The vocabulary with one word per row, and the squared norm of
+		// each word, for the nearest word search
+		MatF word_matrix;
+		VecF word_norms;
+
 		// Reset internal buffers
 		void Reset(const ImageBundle& image);
 		// Segment part of the image, used for parallelization
 		void ProcessRows(int begin_row, int end_row);
+		// Count the number of pixels assigned to each texton
+		void CountTextons();
 	};
 
 }
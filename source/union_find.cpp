@@ -44,6 +44,13 @@ int UnionFind::GetGroup(int v) const {
 	return v;
 }
 
+int UnionFind::GetGroupConst(int v) const {
+	while (parents[v] != v) {
+		v = parents[v];
+	}
+	return v;
+}
+
 int UnionFind::Merge(int a, int b) {
 	const int ga = GetGroup(a);
 	const int gb = GetGroup(b);
@@ -54,6 +61,20 @@ int UnionFind::Merge(int a, int b) {
 	return ga;
 }
 
+int UnionFind::MergeMin(int a, int b) {
+	const int ga = GetGroup(a);
+	const int gb = GetGroup(b);
+	if (ga < gb) {
+		parents[gb] = ga;
+		num_groups--;
+		return ga;
+	} else if (gb < ga) {
+		parents[ga] = gb;
+		num_groups--;
+	}
+	return gb;
+}
+
 bool UnionFind::Joined(int a, int b) const {
 	return GetGroup(a) == GetGroup(b);
 }
@@ -29,11 +29,20 @@ public:
 	// same group ID if and only if they are in the same group.
 	int GetGroup(int v) const;
 
+	// As above but without path compression, so this is safe to call
+	// concurrently from several threads
+	int GetGroupConst(int v) const;
+
 	// Merges the group to which A belongs with the group to which B
 	// belongs. Returns the ID of the group to which both objects now
 	// belong.
 	int Merge(int a, int b);
 
+	// As above, but the smaller of the two group IDs always becomes the
+	// ID of the merged group, so the final groups and their IDs do not
+	// depend on the order of merges
+	int MergeMin(int a, int b);
+
 	// Returns true if A and B are in the same group
 	bool Joined(int a, int b) const;
 
@@ -1,5 +1,7 @@
 #include "vanishing_point_model.h"
 
+#include <map>
+
 #include <TooN/so3.h>
 
 #include "common_types.h"
@@ -18,9 +20,13 @@
 #include "vector_utils.tpp"
 #include "format_utils.tpp"
 #include "numerical_jacobian.tpp"
+#include "worker.h"
 
 namespace indoor_context {
 	using namespace toon;
+	using boost::bind;
+	using boost::ref;
+	using boost::cref;
 
 	// The prior probability of a spurious detection. 
 	static const double kSpuriousPrior = .2;
@@ -45,6 +51,260 @@ namespace indoor_context {
 		return R * SO3<>::exp(m);
 	}
 
+	/////////////////////////////////////////////////////////////////////////
+	LineObservationBatch::LineObservationBatch(const vector<LineObservation>& obs) {
+		Configure(obs);
+	}
+
+	void LineObservationBatch::Configure(const vector<LineObservation>& obs) {
+		// Assign frame ids in order of first appearance
+		map<const PosedCamera*, int> frame_ids;
+		vector<int> obs_frames(obs.size());
+		frames.clear();
+		for (int i = 0; i < obs.size(); i++) {
+			CHECK(obs[i].camera != NULL) << "Observation " << i << " has no camera";
+			map<const PosedCamera*, int>::iterator it = frame_ids.find(obs[i].camera);
+			if (it == frame_ids.end()) {
+				Frame frame;
+				frame.camera = obs[i].camera;
+				frame.first = 0;
+				frame.count = 0;
+				it = frame_ids.insert(make_pair(obs[i].camera, frames.size())).first;
+				frames.push_back(frame);
+			}
+			obs_frames[i] = it->second;
+			frames[it->second].count++;
+		}
+		for (int f = 1; f < frames.size(); f++) {
+			frames[f].first = frames[f-1].first + frames[f-1].count;
+		}
+
+		// Scatter observations into their frames (stable within each frame)
+		const int n = obs.size();
+		index.resize(n);
+		start_xs.resize(n);
+		start_ys.resize(n);
+		start_ws.resize(n);
+		mid_xs.resize(n);
+		mid_ys.resize(n);
+		mid_ws.resize(n);
+		vector<int> next(frames.size());
+		for (int f = 0; f < frames.size(); f++) {
+			next[f] = frames[f].first;
+		}
+		for (int i = 0; i < n; i++) {
+			int j = next[obs_frames[i]]++;
+			const LineSegment& seg = obs[i].segment;
+			Vec3 midp = seg.midpoint();
+			index[j] = i;
+			start_xs[j] = seg.start[0];
+			start_ys[j] = seg.start[1];
+			start_ws[j] = seg.start[2];
+			mid_xs[j] = midp[0];
+			mid_ys[j] = midp[1];
+			mid_ws[j] = midp[2];
+		}
+	}
+
+	/////////////////////////////////////////////////////////////////////////
+	// Batched kernels
+
+	// Per-frame quantities that depend on the camera. These are computed
+	// on the calling thread because camera models are not thread-safe.
+	struct FrameProjection {
+		double vpts[3][3];  // vanishing point for each axis
+		Mat3 jacobians[3];  // derivative of each vanishing point w.r.t. R
+	};
+
+	static void PrepareFrameProjections(const LineObservationBatch& batch,
+																			const SO3<>& R,
+																			bool with_jacobians,
+																			vector<FrameProjection>& projs) {
+		projs.resize(batch.frames.size());
+		for (int f = 0; f < batch.frames.size(); f++) {
+			const PosedCamera& camera = *batch.frames[f].camera;
+			for (int k = 0; k < 3; k++) {
+				Vec3 vpt = ProjectVanishingPoint(k, R, camera);
+				for (int j = 0; j < 3; j++) {
+					projs[f].vpts[k][j] = vpt[j];
+				}
+			}
+			if (with_jacobians) {
+				// This is G_R from ComputeDistGradient
+				Mat3 M = camera.camera().Linearize()
+					* camera.pose().get_rotation().get_matrix()
+					* R.get_matrix();
+				for (int k = 0; k < 3; k++) {
+					for (int i = 0; i < 3; i++) {
+						projs[f].jacobians[k].T()[i] = M * SO3<>::generator_field(i, GetAxis<3>(k));
+					}
+				}
+			}
+		}
+	}
+
+	// Compute the signed reprojection error of each observation in
+	// [first,first+count) with respect to vpt. Also outputs the line
+	// through vpt and each midpoint, which the gradient kernel needs.
+	static void ComputeBatchReprojErrors(const LineObservationBatch& batch,
+																			 int first,
+																			 int count,
+																			 const double* vpt,
+																			 double* dists,
+																			 double* lxs,
+																			 double* lys,
+																			 double* lzs) {
+		const double* axs = &batch.start_xs[first];
+		const double* ays = &batch.start_ys[first];
+		const double* aws = &batch.start_ws[first];
+		const double* mxs = &batch.mid_xs[first];
+		const double* mys = &batch.mid_ys[first];
+		const double* mws = &batch.mid_ws[first];
+		const double vx = vpt[0], vy = vpt[1], vw = vpt[2];
+		for (int i = 0; i < count; i++) {
+			// line = vpt ^ midpoint
+			double lx = vy*mws[i] - vw*mys[i];
+			double ly = vw*mxs[i] - vx*mws[i];
+			double lz = vx*mys[i] - vy*mxs[i];
+			double nrm = sqrt(lx*lx + ly*ly);
+			dists[i] = (axs[i]*lx + ays[i]*ly + aws[i]*lz) / (aws[i] * nrm);
+			lxs[i] = lx;
+			lys[i] = ly;
+			lzs[i] = lz;
+		}
+	}
+
+	// Compute posteriors for frames f0..f1 (inclusive)
+	static void ComputePosteriorRange(const LineObservationBatch& batch,
+																		const vector<FrameProjection>& projs,
+																		double line_sigma_sqr,
+																		MatD& resps,
+																		int f0,
+																		int f1) {
+		const double log_vpt_prior = log((1. - kSpuriousPrior) / 3.);
+		const double log_norm = LogGauss1D(0, 0, line_sigma_sqr);
+		const double spurious_loglik = log(kSpuriousPrior) + log(kSpuriousLik);
+		vector<double> buffer;
+		for (int f = f0; f <= f1; f++) {
+			const int first = batch.frames[f].first;
+			const int n = batch.frames[f].count;
+			buffer.resize(n*7);
+			double* dists = &buffer[0];
+			double* lxs = &buffer[n];
+			double* lys = &buffer[2*n];
+			double* lzs = &buffer[3*n];
+			double* lls[] = { &buffer[4*n], &buffer[5*n], &buffer[6*n] };
+			for (int k = 0; k < 3; k++) {
+				ComputeBatchReprojErrors(batch, first, n, projs[f].vpts[k],
+																 dists, lxs, lys, lzs);
+				double* ll = lls[k];
+				for (int i = 0; i < n; i++) {
+					ll[i] = log_vpt_prior + log_norm - dists[i]*dists[i] / (2*line_sigma_sqr);
+				}
+			}
+
+			// Normalize and compute posterior (in a numerically stable way)
+			for (int i = 0; i < n; i++) {
+				double log_resps[] = { lls[0][i], lls[1][i], lls[2][i], spurious_loglik };
+				double denom = LogSumExp(log_resps, 4);
+				double* row = resps[batch.index[first+i]];
+				for (int j = 0; j < 4; j++) {
+					row[j] = exp(log_resps[j] - denom);
+				}
+			}
+		}
+	}
+
+	// Compute the expected log likelihood of frames f0..f1 (inclusive)
+	static void ComputeExpectedLogLikRange(const LineObservationBatch& batch,
+																				 const vector<FrameProjection>& projs,
+																				 const MatD& resps,
+																				 double line_sigma_sqr,
+																				 vector<double>& frame_logliks,
+																				 int f0,
+																				 int f1) {
+		const double log_vpt_prior = log((1. - kSpuriousPrior) / 3.);
+		const double log_norm = LogGauss1D(0, 0, line_sigma_sqr);
+		const double spurious_loglik = log(kSpuriousPrior) + log(kSpuriousLik);
+		vector<double> buffer;
+		for (int f = f0; f <= f1; f++) {
+			const int first = batch.frames[f].first;
+			const int n = batch.frames[f].count;
+			buffer.resize(n*4);
+			double* dists = &buffer[0];
+			double* lxs = &buffer[n];
+			double* lys = &buffer[2*n];
+			double* lzs = &buffer[3*n];
+			double loglik = 0.;
+			for (int k = 0; k < 3; k++) {
+				ComputeBatchReprojErrors(batch, first, n, projs[f].vpts[k],
+																 dists, lxs, lys, lzs);
+				for (int i = 0; i < n; i++) {
+					double cll = log_vpt_prior + log_norm - dists[i]*dists[i] / (2*line_sigma_sqr);
+					loglik += resps[batch.index[first+i]][k] * cll;
+				}
+			}
+			for (int i = 0; i < n; i++) {
+				loglik += resps[batch.index[first+i]][3] * spurious_loglik;
+			}
+			frame_logliks[f] = loglik;
+		}
+	}
+
+	// Compute the gradient of the expected log likelihood for frames
+	// f0..f1 (inclusive). This is ComputeSegmentLogLikGradient written out
+	// over the separate arrays, with the product by G_R hoisted out of
+	// the loop over observations.
+	static void ComputeGradientRange(const LineObservationBatch& batch,
+																	 const vector<FrameProjection>& projs,
+																	 const MatD& resps,
+																	 double line_sigma_sqr,
+																	 vector<Vec3>& frame_grads,
+																	 int f0,
+																	 int f1) {
+		vector<double> buffer;
+		for (int f = f0; f <= f1; f++) {
+			const int first = batch.frames[f].first;
+			const int n = batch.frames[f].count;
+			buffer.resize(n*4);
+			double* dists = &buffer[0];
+			double* lxs = &buffer[n];
+			double* lys = &buffer[2*n];
+			double* lzs = &buffer[3*n];
+			const double* axs = &batch.start_xs[first];
+			const double* ays = &batch.start_ys[first];
+			const double* aws = &batch.start_ws[first];
+			const double* mxs = &batch.mid_xs[first];
+			const double* mys = &batch.mid_ys[first];
+			const double* mws = &batch.mid_ws[first];
+
+			Vec3 G = Zeros;
+			for (int k = 0; k < 3; k++) {
+				ComputeBatchReprojErrors(batch, first, n, projs[f].vpts[k],
+																 dists, lxs, lys, lzs);
+				// Accumulate sum_i coef_i * (v_i ^ midpoint_i), where v_i is
+				// (term1 - term2) from ComputeDistGradient
+				double sx = 0., sy = 0., sw = 0.;
+				for (int i = 0; i < n; i++) {
+					double eta_sqr = lxs[i]*lxs[i] + lys[i]*lys[i];
+					double eta = sqrt(eta_sqr);
+					double la = axs[i]*lxs[i] + ays[i]*lys[i] + aws[i]*lzs[i];
+					double s = la / (eta_sqr*eta);
+					double vx = s*lxs[i] - axs[i]/eta;
+					double vy = s*lys[i] - ays[i]/eta;
+					double vw = -aws[i]/eta;
+					double coef = -resps[batch.index[first+i]][k] * dists[i]
+						/ (line_sigma_sqr * aws[i]);
+					sx += coef * (vy*mws[i] - vw*mys[i]);
+					sy += coef * (vw*mxs[i] - vx*mws[i]);
+					sw += coef * (vx*mys[i] - vy*mxs[i]);
+				}
+				G += makeVector(sx, sy, sw) * projs[f].jacobians[k];
+			}
+			frame_grads[f] = G;
+		}
+	}
+
 	/////////////////////////////////////////////////////////////////////////
 	double VanishingPointModel::ComputeSegmentLogLik(const LineSeg& seg,
 																									 const Vec3& vpt) const {
@@ -92,6 +352,28 @@ namespace indoor_context {
 		return loglik;		
 	}
 
+	double VanishingPointModel::ComputeBatchExpectedLogLik(const LineObservationBatch& batch,
+																												 const MatD& responsibilities,
+																												 const SO3<>& R) const {
+		CHECK_EQ(responsibilities.Rows(), batch.size());
+		CHECK_EQ(responsibilities.Cols(), 4);
+
+		vector<FrameProjection> projs;
+		PrepareFrameProjections(batch, R, false, projs);
+		vector<double> frame_logliks(batch.frames.size());
+		ParallelPartition(batch.frames.size(),
+											bind(&ComputeExpectedLogLikRange,
+													 cref(batch), cref(projs), cref(responsibilities),
+													 line_sigma_sqr, ref(frame_logliks), _1, _2));
+
+		// Sum in frame order so that the result is deterministic
+		double loglik = 0.;
+		for (int f = 0; f < frame_logliks.size(); f++) {
+			loglik += frame_logliks[f];
+		}
+		return loglik;
+	}
+
 	////////////////////////////////////////////////////////////////////////
 	// Posteriors
 
@@ -118,6 +400,19 @@ namespace indoor_context {
 		}
 	}
 
+	void VanishingPointModel::ComputeBatchPosteriorOnLabels(const LineObservationBatch& batch,
+																													const toon::SO3<>& R,
+																													MatD& resps) const {
+		CHECK_EQ(resps.Rows(), batch.size());
+		CHECK_EQ(resps.Cols(), 4);
+
+		vector<FrameProjection> projs;
+		PrepareFrameProjections(batch, R, false, projs);
+		ParallelPartition(batch.frames.size(),
+											bind(&ComputePosteriorRange,
+													 cref(batch), cref(projs), line_sigma_sqr, ref(resps), _1, _2));
+	}
+
 
 	////////////////////////////////////////////////////////////////////////
 	// Gradients
@@ -195,6 +490,28 @@ namespace indoor_context {
 		return G;
 	}
 
+	Vec3 VanishingPointModel::ComputeBatchExpectedLogLikGradient(const LineObservationBatch& batch,
+																															 const MatD& responsibilities,
+																															 const SO3<>& Rcur) const {
+		CHECK_EQ(responsibilities.Rows(), batch.size());
+		CHECK_EQ(responsibilities.Cols(), 4);
+
+		vector<FrameProjection> projs;
+		PrepareFrameProjections(batch, Rcur, true, projs);
+		vector<Vec3> frame_grads(batch.frames.size());
+		ParallelPartition(batch.frames.size(),
+											bind(&ComputeGradientRange,
+													 cref(batch), cref(projs), cref(responsibilities),
+													 line_sigma_sqr, ref(frame_grads), _1, _2));
+
+		// Sum in frame order so that the result is deterministic
+		Vec3 G = Zeros;
+		for (int f = 0; f < frame_grads.size(); f++) {
+			G += frame_grads[f];
+		}
+		return G;
+	}
+
 	Vec3 VanishingPointModel::ComputeCompleteLogLik_NumericGradient(const CompleteData& data,
 																																	const SO3<>& Rcur,
 																																	double delta) const {
@@ -373,17 +690,18 @@ namespace indoor_context {
 																					const VanishingPointModel& m) {
 		observations = &obs;
 		model = &m;
+		batch.Configure(obs);
 		responsibilities.Resize(observations->size(), 4);
 
 		// Configure the optimizer
-		optimizer.f = boost::bind(&VanishingPointModel::ComputeExpectedLogLik,
+		optimizer.f = boost::bind(&VanishingPointModel::ComputeBatchExpectedLogLik,
 															ref(*model),
-															ref(*observations),
+															ref(batch),
 															ref(responsibilities),
 															_1);
-		optimizer.Jf = boost::bind(&VanishingPointModel::ComputeExpectedLogLikGradient,
+		optimizer.Jf = boost::bind(&VanishingPointModel::ComputeBatchExpectedLogLikGradient,
 															 ref(*model),
-															 ref(*observations),
+															 ref(batch),
 															 ref(responsibilities),
 															 _1);
 	}
@@ -420,7 +738,7 @@ namespace indoor_context {
 		// Note that in the very first iteration, R_cur will not equal
 		// optimizer.Rcur. This cannot be avoided since we must compute
 		// responsibilities before initializing the optimizer.
-		model->ComputePosteriorOnLabels(*observations, R_cur, responsibilities);
+		model->ComputeBatchPosteriorOnLabels(batch, R_cur, responsibilities);
 	}
 
 	void VanishingPointEstimator::MStep() {
@@ -30,6 +30,35 @@ namespace indoor_context {
 	///////////////////////////////////////////////////////////////////////////
 	typedef vector<pair<LineObservation,int> > CompleteData;
 
+	///////////////////////////////////////////////////////////////////////////
+	// Line observations from many frames, grouped by camera and stored as
+	// separate coordinate arrays so that the batched kernels in
+	// VanishingPointModel can process each frame in a tight loop.
+	class LineObservationBatch {
+	public:
+		// A contiguous run of observations that share a camera
+		struct Frame {
+			const PosedCamera* camera;
+			int first;  // index of the first observation in this frame
+			int count;  // number of observations in this frame
+		};
+		vector<Frame> frames;
+		// For each batched observation, its index in the original vector
+		vector<int> index;
+		// Segment start points (homogeneous)
+		vector<double> start_xs, start_ys, start_ws;
+		// Segment midpoints (homogeneous)
+		vector<double> mid_xs, mid_ys, mid_ws;
+
+		// Constructors
+		LineObservationBatch() { }
+		LineObservationBatch(const vector<LineObservation>& observations);
+		// Group observations by camera, preserving the order within each camera
+		void Configure(const vector<LineObservation>& observations);
+		// Number of observations
+		inline int size() const { return index.size(); }
+	};
+
 	///////////////////////////////////////////////////////////////////////////
 	class VanishingPointModel {
 	public:
@@ -57,12 +86,22 @@ namespace indoor_context {
 																 const MatD& responsibilities,
 																 const toon::SO3<>& R) const;
 
+		// Batched equivalent of ComputeExpectedLogLik. Rows of
+		// responsibilities correspond to the original observation order.
+		double ComputeBatchExpectedLogLik(const LineObservationBatch& batch,
+																			const MatD& responsibilities,
+																			const toon::SO3<>& R) const;
+
 		//
 		// Posteriors
 		//
 		void ComputePosteriorOnLabels(const vector<LineObservation>& data,
 																	const toon::SO3<>& R,
 																	MatD& out_responsibilities) const;
+		// Batched equivalent of ComputePosteriorOnLabels, parallel across frames
+		void ComputeBatchPosteriorOnLabels(const LineObservationBatch& batch,
+																			 const toon::SO3<>& R,
+																			 MatD& out_responsibilities) const;
 
 		//
 		// Gradients
@@ -83,6 +122,10 @@ namespace indoor_context {
 		Vec3 ComputeExpectedLogLikGradient(const vector<LineObservation>& data,
 																			 const MatD& responsibilities,
 																			 const toon::SO3<>& Rcur) const;
+		// Batched equivalent of ComputeExpectedLogLikGradient, parallel across frames
+		Vec3 ComputeBatchExpectedLogLikGradient(const LineObservationBatch& batch,
+																						const MatD& responsibilities,
+																						const toon::SO3<>& Rcur) const;
 
 		// Numeric gradients for verification
 		Vec3 ComputeCompleteLogLik_NumericGradient(const CompleteData& data,
@@ -158,6 +201,7 @@ namespace indoor_context {
 		const vector<LineObservation>* observations;
 		const VanishingPointModel* model;
 		RotationOptimizer optimizer;
+		LineObservationBatch batch;  // observations grouped by frame
 
 		scoped_ptr<VanishingPointModel> owned_model;  // for managing memory only
 		toon::SO3<> R_cur;   // current estimate
@@ -21,9 +21,13 @@
 #include "image_utils.tpp"
 #include "vector_utils.tpp"
 #include "counted_foreach.tpp"
+#include "worker.h"
 
 namespace indoor_context {
 	using namespace toon;
+	using boost::bind;
+	using boost::ref;
+	using boost::ptr_vector;
 
 	// These are documented in vanishing_points.cfg
 	const lazyvar<string> gvDefaultStrategy("VanPts.DefaultStrategy");
@@ -36,6 +40,7 @@ namespace indoor_context {
 	const lazyvar<double> gvExitThresh("EMVanPts.ExitThreshold");
 	const lazyvar<double> gvSpuriousLogLik("EMVanPts.SpuriousLogLik");
 	const lazyvar<float> gvAdoptThresh("EMVanPts.AdoptThreshold");
+	const lazyvar<int> gvNumStarts("EMVanPts.NumStarts");
 
 	const lazyvar<int> gvNumIters("RansacVanPts.NumIterations");
 	const lazyvar<float> gvVoteThresh("RansacVanPts.VoteThreshold");
@@ -70,7 +75,17 @@ namespace indoor_context {
 
 	
 	void ManhattanFrameEstimator::Compute(vector<LineDetection>& segments) {
-		Compute(segments, Bootstrap(segments));
+		if (*gvNumStarts <= 1) {
+			Compute(segments, Bootstrap(segments));
+		} else {
+			// Bootstrap uses rand() so generate the initializations here
+			// rather than in parallel
+			vector<SO3<> > inits;
+			for (int i = 0; i < *gvNumStarts; i++) {
+				inits.push_back(Bootstrap(segments));
+			}
+			ComputeMultiStart(segments, inits);
+		}
 	}
 
 	void ManhattanFrameEstimator::Compute(vector<LineDetection>& segments,
@@ -82,13 +97,58 @@ namespace indoor_context {
 		Prepare(segments);
 
 		// Run EM
-		for (num_iters = 0; !converged && num_iters < 100; num_iters++) {
-			EStep();
-			MStep();
+		RunEM();
+		Finish();
+
+		// Report the final results
+		if (converged) {
+			DLOG << "EM converged after " << num_iters << " iterations";
+		} else {
+			DLOG << "EM failed to converge after " << num_iters << " iterations";
+		}
+		DLOG << "Final vanishing points:";
+		INDENTED {
+			for (int i = 0; i < 3; i++) {
+				DLOG << project(vpts[i]) << " (Support: " << support[i] << ")";
+			}
+			DLOG << "plus " << num_spurious << " unassigned line segments";
+		}
+	}
+
+	void ManhattanFrameEstimator::ComputeMultiStart(vector<LineDetection>& segments,
+	                                                const vector<SO3<> >& inits) {
+		TITLE("Computing vanishing points from " << inits.size() << " starts");
+		CHECK(!inits.empty());
+
+		// Each start gets its own estimator so that they share no state
+		boost::ptr_vector<ManhattanFrameEstimator> ests(inits.size());
+		for (int i = 0; i < inits.size(); i++) {
+			ests.push_back(new ManhattanFrameEstimator);
+			ests[i].R = inits[i];
+			ests[i].Prepare(segments);
+		}
+		ParallelPartition(inits.size(), bind(&RunEMRange, ref(ests), _1, _2));
+
+		// Keep the most likely result
+		int best = 0;
+		for (int i = 1; i < ests.size(); i++) {
+			if (ests[i].loglik > ests[best].loglik) {
+				best = i;
+			}
+		}
+		R = ests[best].R;
+		Prepare(segments);
+		resps = ests[best].resps;
+		loglik = ests[best].loglik;
+		num_iters = ests[best].num_iters;
+		converged = ests[best].converged;
+		for (int i = 0; i < 3; i++) {
+			vpts[i] = ests[best].vpts[i];
 		}
 		Finish();
 
 		// Report the final results
+		DLOG << "Selected start " << best << " with log likelihood " << loglik;
 		if (converged) {
 			DLOG << "EM converged after " << num_iters << " iterations";
 		} else {
@@ -103,6 +163,21 @@ namespace indoor_context {
 		}
 	}
 
+	// static
+	void ManhattanFrameEstimator::RunEMRange(ptr_vector<ManhattanFrameEstimator>& ests,
+	                                         int i0, int i1) {
+		for (int i = i0; i <= i1; i++) {
+			ests[i].RunEM();
+		}
+	}
+
+	void ManhattanFrameEstimator::RunEM() {
+		for (num_iters = 0; !converged && num_iters < 100; num_iters++) {
+			EStep();
+			MStep();
+		}
+	}
+
 	SO3<> ManhattanFrameEstimator::Bootstrap(const vector<LineDetection>& segments) {
 		CHECK_GE(segments.size(), *gvNumBootstrapClusters)
 			<< "Too few segments were provided to bootstrap the "
@@ -184,8 +259,22 @@ namespace indoor_context {
 
 		line_eqns.clear();
 		line_eqns.reserve(segments.size());
-		BOOST_FOREACH(const LineDetection& det, segments) {
-			line_eqns.push_back(det.eqn);
+		line_xs.resize(segments.size());
+		line_ys.resize(segments.size());
+		line_zs.resize(segments.size());
+		for (int i = 0; i < segments.size(); i++) {
+			const Vec3& eqn = segments[i].eqn;
+			line_eqns.push_back(eqn);
+			line_xs[i] = eqn[0];
+			line_ys[i] = eqn[1];
+			line_zs[i] = eqn[2];
+		}
+		log_liks.Resize(3, segments.size());
+		loglik = -INFINITY;
+
+		// The convergence test in MStep compares against these
+		for (int i = 0; i < 3; i++) {
+			vpts[i] = col(R,i);
 		}
 
 		converged = false;
@@ -226,20 +315,40 @@ namespace indoor_context {
 	}
 
 	void ManhattanFrameEstimator::EStep() {
-		CHECK_EQ(resps.Rows(), detections->size());
+		const int n = line_eqns.size();
+		CHECK_EQ(resps.Rows(), n);
 		CHECK_EQ(resps.Cols(), 4);
-		// Update responsibilities given current vanishing points
-		for (int i = 0; i < detections->size(); i++) {
-			double log_resps[] = {0,0,0,*gvSpuriousLogLik};
-			for (int j = 0; j < 3; j++) {
-				log_resps[j] = GetLogLik(col(R,j), (*detections)[i].eqn);
+		CHECK_EQ(log_liks.Cols(), n);
+
+		// Compute the log likelihood of each line for each vanishing
+		// point. This is GetLogLik() written out over the separate arrays
+		// so that the inner loop vectorizes.
+		const double sigma = *gvErrorModelSigma;
+		const double* xs = &line_xs[0];
+		const double* ys = &line_ys[0];
+		const double* zs = &line_zs[0];
+		for (int j = 0; j < 3; j++) {
+			const double vx = R.get_matrix()[0][j];
+			const double vy = R.get_matrix()[1][j];
+			const double vz = R.get_matrix()[2][j];
+			double* out = log_liks[j];
+			for (int i = 0; i < n; i++) {
+				const double dp = vx*xs[i] + vy*ys[i] + vz*zs[i];
+				out[i] = -dp*dp / (2.0 * sigma * sigma);
 			}
+		}
 
+		// Update responsibilities given current vanishing points
+		loglik = 0;
+		for (int i = 0; i < n; i++) {
 			// Last component represents "not an axis-aligned edge"
+			double log_resps[] = {log_liks[0][i], log_liks[1][i], log_liks[2][i],
+			                      *gvSpuriousLogLik};
 			const double denom = LogSumExp(log_resps, 4);
 			for (int j = 0; j < 4; j++) {
 				resps[i][j] = exp(log_resps[j] - denom);
 			}
+			loglik += denom;
 		}
 	}
 
@@ -318,42 +427,155 @@ namespace indoor_context {
 		return svd.get_VT()[2];
 	}
 
+	// A batch of RANSAC hypotheses that are scored preemptively: all
+	// hypotheses are scored on a block of lines, the worse half are
+	// discarded, and this repeats until one hypothesis is left, which is
+	// then scored on all remaining lines.
+	struct PreemptiveBatch {
+		vector<Vec3> hyps;
+		Vec3 best;
+		float best_score;
+	};
+
+	// Score the batches in the interval [b0,b1]. Lines are visited in the
+	// order given by ORDER, which should be a random permutation.
+	void ScorePreemptiveBatches(const vector<LineDetection>& segments,
+	                            const vector<float>& weights,
+	                            const vector<int>& order,
+	                            vector<PreemptiveBatch>& batches,
+	                            int b0, int b1) {
+		static const int kBlockSize = 16;
+		const float kVoteThresh = *gvVoteThresh;
+		for (int b = b0; b <= b1; b++) {
+			PreemptiveBatch& batch = batches[b];
+			vector<pair<float, int> > survivors;
+			for (int k = 0; k < batch.hyps.size(); k++) {
+				survivors.push_back(make_pair(0.0f, k));
+			}
+
+			int pos = 0;
+			while (pos < order.size()) {
+				// Score every survivor on the next block, or on all remaining
+				// lines once there is only one survivor
+				const int end = survivors.size() == 1 ?
+					order.size() : min<int>(pos+kBlockSize, order.size());
+				for (int k = 0; k < survivors.size(); k++) {
+					const Vec3& isct = batch.hyps[survivors[k].second];
+					for (int i = pos; i < end; i++) {
+						// TODO: use the propper error here as per PointLineDist
+						const double err = abs(isct * segments[order[i]].eqn);
+						if (err < kVoteThresh) {
+							survivors[k].first += weights[order[i]];
+						}
+					}
+				}
+				pos = end;
+
+				// Keep the better half, preferring earlier hypotheses on ties
+				if (survivors.size() > 1 && pos < order.size()) {
+					for (int k = 0; k < survivors.size(); k++) {
+						survivors[k].second = -survivors[k].second;
+					}
+					sort(survivors.begin(), survivors.end(), greater<pair<float, int> >());
+					survivors.resize((survivors.size()+1) / 2);
+					for (int k = 0; k < survivors.size(); k++) {
+						survivors[k].second = -survivors[k].second;
+					}
+				}
+			}
+
+			// Pick the best of whatever survived
+			batch.best_score = -1;
+			for (int k = 0; k < survivors.size(); k++) {
+				if (survivors[k].first > batch.best_score) {
+					batch.best_score = survivors[k].first;
+					batch.best = batch.hyps[survivors[k].second];
+				}
+			}
+		}
+	}
+
 	Vec3 ManhattanFrameEstimator::FitIsctRansac(const vector<LineDetection>& segments,
 																							const Vector<>& weights) const {
+		static const int kBatchSize = 16;
+		// Fixed so that the hypotheses drawn, and hence the result, do not
+		// depend on the number of threads
+		static const int kBatchesPerRound = 4;
+		static const double kConfidence = 0.99;
+
+		// Lines with zero weight never change the score so leave them out
+		// entirely. If no weights were given then all lines count equally.
+		const int n = segments.size();
+		const bool weighted = weights.size() == n;
+		vector<float> wts(n, 1.0);
+		vector<int> order;
+		for (int i = 0; i < n; i++) {
+			if (weighted) {
+				CHECK_GE(weights[i], 0);
+				wts[i] = weights[i];
+			}
+			if (wts[i] > 0) {
+				order.push_back(i);
+			}
+		}
+		CHECK_GE(order.size(), 2) << "Too few lines with non-zero weight for RANSAC";
+
 		// Generate cumulative weight vector
-		const double wsum_check = norm_1(weights);
-		const double wsum = sum(weights);
-		CHECK_EQ_TOL(wsum, wsum_check, 1e-8);
-		Vector<> wcum(weights.size());
-		wcum[0] = weights[0];
-		for (int i = 1; i < weights.size(); i++) {
-			wcum[i] = wcum[i-1] + weights[i];
-		}
-
-		// Iterate RANSAC
-		const int num_iters = min(100, max(wsum, wsum*wsum / 5));
-		Vec3 max_isct;
+		vector<double> wcum(n);
+		wcum[0] = wts[0];
+		for (int i = 1; i < n; i++) {
+			wcum[i] = wcum[i-1] + wts[i];
+		}
+		const double wsum = wcum[n-1];
+
+		// Visit lines in random order so that the first blocks are a
+		// representative sample
+		for (int i = order.size()-1; i > 0; i--) {
+			swap(order[i], order[rand() % (i+1)]);
+		}
+
+		// Iterate RANSAC. The batches in each round are scored in parallel.
+		const int max_hyps = min(100, max(wsum, wsum*wsum / 5));
+		const int num_threads = Clamp(Worker::DefaultNumThreads(), 1, kBatchesPerRound);
+		int num_hyps = 0;
+		int required_hyps = max_hyps;
+		Vec3 max_isct = Zeros;
 		float max_score = -1;
-		for (int i = 0; i < num_iters; i++) {
-			int a, b;
-			do {
-				const double ra = rand() * wsum / RAND_MAX;
-				a = lower_bound(begin(wcum), end(wcum), ra) - begin(wcum);
-				const double rb = rand() * wsum / RAND_MAX;
-				b = lower_bound(begin(wcum), end(wcum), rb) - begin(wcum);
-			} while (a == b);
-			Vec3 isct = unit(segments[a].eqn ^ segments[b].eqn);
-			float score = 0.0;
-			for (int j = 0; j < segments.size(); j++) {
-				// TODO: use the propper error here as per PointLineDist
-				const double err = abs(isct * segments[j].eqn);
-				if (err < *gvVoteThresh) {
-					score += weights[j];
+		vector<PreemptiveBatch> batches;
+		while (num_hyps < min(max_hyps, required_hyps)) {
+			// Generate hypotheses here since rand() is not thread-safe
+			batches.clear();
+			while (batches.size() < kBatchesPerRound && num_hyps < min(max_hyps, required_hyps)) {
+				batches.push_back(PreemptiveBatch());
+				for (int k = 0; k < kBatchSize && num_hyps < max_hyps; k++, num_hyps++) {
+					int a, b;
+					do {
+						const double ra = rand() * wsum / RAND_MAX;
+						a = lower_bound(wcum.begin(), wcum.end(), ra) - wcum.begin();
+						const double rb = rand() * wsum / RAND_MAX;
+						b = lower_bound(wcum.begin(), wcum.end(), rb) - wcum.begin();
+					} while (a == b);
+					batches.back().hyps.push_back(unit(segments[a].eqn ^ segments[b].eqn));
 				}
 			}
-			if (score > max_score) {
-				max_score = score;
-				max_isct = isct;
+
+			ParallelPartition(batches.size(), min<int>(batches.size(), num_threads),
+			                  bind(&ScorePreemptiveBatches,
+			                       ref(segments), ref(wts), ref(order), ref(batches), _1, _2));
+			BOOST_FOREACH(const PreemptiveBatch& batch, batches) {
+				if (batch.best_score > max_score) {
+					max_score = batch.best_score;
+					max_isct = batch.best;
+				}
+			}
+
+			// Stop once we have probably drawn an all-inlier pair, given the
+			// inlier ratio of the best hypothesis so far
+			const double inlier_ratio = max_score / wsum;
+			if (inlier_ratio >= 1.0) {
+				break;
+			} else if (inlier_ratio > 0) {
+				required_hyps = ceil(log(1.0-kConfidence) / log(1.0-inlier_ratio*inlier_ratio));
 			}
 		}
 		return max_isct;
@@ -19,6 +19,9 @@ namespace indoor_context {
 		vector<LineDetection>* detections;
 		// The equations of the above lines, cached in this form for efficiency
 		vector<Vec3> line_eqns;
+		// The components of the above line equations, laid out as
+		// separate arrays so the E-step vectorizes
+		vector<double> line_xs, line_ys, line_zs;
 
 		// Best rotation
 		toon::SO3<> R;
@@ -37,7 +40,7 @@ namespace indoor_context {
 		// These are updated during the estimation process:
 		//
 
-		// Current log likelihood
+		// Log likelihood of the line segments, as of the last E-step
 		double loglik;
 		// Number of iterations so far
 		int num_iters;
@@ -45,13 +48,21 @@ namespace indoor_context {
 		bool converged;
 		// Responsibility of each vanishing point for each line segment.
 		MatD resps;
+		// Log likelihood of each line segment for each vanishing point
+		MatD log_liks;
 		// Rotation estimator
 		RotationEstimator rot_est;
 
-		// Estimate the Manhattan coordinate frame
+		// Estimate the Manhattan coordinate frame. If
+		// EMVanPts.NumStarts is greater than one then EM is run from that
+		// many bootstrap initializations and the most likely is kept.
 		void Compute(vector<LineDetection>& segments);
 		// Estimate the Manhattan coordinate frame given an initial estimate
 		void Compute(vector<LineDetection>& segments, const toon::SO3<>& init);
+		// Run EM from each of several initial estimates in parallel and
+		// keep the result with the highest log likelihood
+		void ComputeMultiStart(vector<LineDetection>& segments,
+		                       const vector<toon::SO3<> >& inits);
 
 		// Compute the (approximate) log posterior for a hypothesized coordinate frame
 		double GetLogPosterior(const toon::SO3<>& hypothesis);
@@ -70,6 +81,8 @@ namespace indoor_context {
 		// Estimate vanishing points given current responsibilities.
 		// Also check for convergence.
 		void MStep();
+		// Alternate E- and M-steps until convergence
+		void RunEM();
 		// Populate owners, num_spurious
 		void Finish();
 
@@ -84,6 +97,10 @@ namespace indoor_context {
 		Vec3 FitIsctRansac(const vector<LineDetection>& segments,
 											 const toon::Vector<-1>& weights = toon::Zeros) const;
 
+		// Run EM for each estimator in the interval [i0,i1]
+		static void RunEMRange(boost::ptr_vector<ManhattanFrameEstimator>& ests,
+		                       int i0, int i1);
+
 		// Draw the line detections and vanishing points
 		void DrawVptViz(ImageRGB<byte>& canvas,
 										const ATANCamera& cam,